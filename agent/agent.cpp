@@ -0,0 +1,391 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * JVMTI agent that attaches the hooks listed in a manifest, e.g.:
+ *     java -agentpath:/path/to/libjnihook_agent.so=/path/to/hooks.manifest ...
+ *
+ * Every line of the manifest describes a hook, with the fields separated by
+ * whitespace:
+ *     <class> <method> <descriptor> <library> <symbol> [type=<type>] [offset=<n>] [enabled=<0|1>] [original=<symbol>]
+ * e.g.:
+ *     com/example/Server handle (Ljava/lang/String;)V /opt/hooks/libhooks.so hk_Server_handle original=orig_Server_handle
+ *
+ * - <library> is the library that exports the native hook method, or '-' to look it up
+ *   in the libraries that are already loaded
+ * - <type> is 'native' (default), 'guarded' or 'bytecode' (see `JNIHook_AttachGuarded`
+ *   and `JNIHook_BytecodeAttach`)
+ * - 'original' names a `jmethodID` variable of the library that receives the original method
+ *
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * When the agent is loaded at startup (Agent_OnLoad), no class is loaded yet, so every
+ * hook is registered as a deferred hook and applied while its class loads, without any
+ * redefinition. When it is attached to a running JVM (Agent_OnAttach), the hooks of the
+ * classes that are already loaded are attached right away, and the others are deferred
+ * (the classes that get loaded while the hooks are being deferred are hooked right away too).
+ * Deferred hooks can only be 'native' hooks.
+ */
+
+#include <jnihook.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+        #include <windows.h>
+#else
+        #include <dlfcn.h>
+#endif
+
+#define AGENT_ERR(...) {fprintf(stderr, "[JNIHOOK] " __VA_ARGS__);fflush(stderr);}
+
+typedef struct manifest_entry_t {
+        std::string class_name;  // 'package/ClassName'
+        std::string method_name;
+        std::string signature;
+        std::string library;
+        std::string symbol;
+        std::string type = "native";
+        size_t offset = 0;       // Bytecode hooks only
+        bool enabled = true;     // Guarded hooks only
+        std::string original;
+        size_t line;
+} manifest_entry_t;
+
+static bool g_initialized = false;
+
+static bool
+parse_manifest(const char *path, std::vector<manifest_entry_t> &entries)
+{
+        std::ifstream file(path);
+        std::string line;
+        size_t line_number = 0;
+
+        if (!file) {
+                AGENT_ERR("ERR: Failed to open hook manifest: %s\n", path);
+                return false;
+        }
+
+        while (std::getline(file, line)) {
+                std::istringstream fields(line);
+                manifest_entry_t entry;
+                std::string option;
+
+                ++line_number;
+                if (!(fields >> entry.class_name) || entry.class_name[0] == '#')
+                        continue;
+
+                if (!(fields >> entry.method_name >> entry.signature >> entry.library >> entry.symbol)) {
+                        AGENT_ERR("ERR: Missing fields in hook manifest (line %zu)\n", line_number);
+                        return false;
+                }
+
+                while (fields >> option) {
+                        auto separator = option.find('=');
+                        auto key = option.substr(0, separator);
+                        auto value = separator == std::string::npos ? "" : option.substr(separator + 1);
+
+                        if (key == "type" && (value == "native" || value == "guarded" || value == "bytecode")) {
+                                entry.type = value;
+                        } else if (key == "offset" && value.length() > 0) {
+                                entry.offset = static_cast<size_t>(strtoull(value.c_str(), NULL, 10));
+                        } else if (key == "enabled" && (value == "0" || value == "1")) {
+                                entry.enabled = value == "1";
+                        } else if (key == "original" && value.length() > 0) {
+                                entry.original = value;
+                        } else {
+                                AGENT_ERR("ERR: Invalid option '%s' in hook manifest (line %zu)\n", option.c_str(), line_number);
+                                return false;
+                        }
+                }
+
+                // Accept both 'package.ClassName' and 'package/ClassName'
+                for (auto &c : entry.class_name) {
+                        if (c == '.')
+                                c = '/';
+                }
+
+                entry.line = line_number;
+                entries.push_back(std::move(entry));
+        }
+
+        return true;
+}
+
+static void *
+find_symbol(const std::string &library, const std::string &symbol)
+{
+#ifdef _WIN32
+        HMODULE handle = library == "-" ? GetModuleHandleA(NULL) : LoadLibraryA(library.c_str());
+        if (!handle)
+                return nullptr;
+
+        return reinterpret_cast<void *>(GetProcAddress(handle, symbol.c_str()));
+#else
+        // NOTE: The libraries are never unloaded, the hooks live as long as the JVM
+        void *handle = library == "-" ? dlopen(NULL, RTLD_NOW) : dlopen(library.c_str(), RTLD_NOW | RTLD_GLOBAL);
+        if (!handle)
+                return nullptr;
+
+        return dlsym(handle, symbol.c_str());
+#endif
+}
+
+// Finds the loaded classes that have hooks in the manifest
+// NOTE: If multiple class loaders loaded a class with the same name, the first one is used
+static std::unordered_map<std::string, jclass>
+find_loaded_classes(jvmtiEnv *jvmti, const std::vector<manifest_entry_t> &entries)
+{
+        std::unordered_map<std::string, jclass> classes;
+        jint class_count;
+        jclass *loaded;
+
+        for (auto &entry : entries)
+                classes["L" + entry.class_name + ";"] = NULL;
+
+        if (jvmti->GetLoadedClasses(&class_count, &loaded) != JVMTI_ERROR_NONE)
+                return {};
+
+        for (jint i = 0; i < class_count; ++i) {
+                char *signature;
+
+                if (jvmti->GetClassSignature(loaded[i], &signature, NULL) != JVMTI_ERROR_NONE)
+                        continue;
+
+                auto it = classes.find(signature);
+                if (it != classes.end() && !it->second)
+                        it->second = loaded[i];
+
+                jvmti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+        }
+
+        jvmti->Deallocate(reinterpret_cast<unsigned char *>(loaded));
+
+        std::unordered_map<std::string, jclass> found;
+        for (auto &[signature, clazz] : classes) {
+                if (clazz)
+                        found[signature.substr(1, signature.length() - 2)] = clazz;
+        }
+
+        return found;
+}
+
+// Looks up a method of a class without initializing it
+static jmethodID
+find_method(jvmtiEnv *jvmti, jclass clazz, const std::string &name, const std::string &signature)
+{
+        jint method_count;
+        jmethodID *methods;
+        jmethodID found = NULL;
+
+        if (jvmti->GetClassMethods(clazz, &method_count, &methods) != JVMTI_ERROR_NONE)
+                return NULL;
+
+        for (jint i = 0; i < method_count && !found; ++i) {
+                char *method_name;
+                char *method_signature;
+
+                if (jvmti->GetMethodName(methods[i], &method_name, &method_signature, NULL) != JVMTI_ERROR_NONE)
+                        continue;
+
+                if (name == method_name && signature == method_signature)
+                        found = methods[i];
+
+                jvmti->Deallocate(reinterpret_cast<unsigned char *>(method_name));
+                jvmti->Deallocate(reinterpret_cast<unsigned char *>(method_signature));
+        }
+
+        jvmti->Deallocate(reinterpret_cast<unsigned char *>(methods));
+
+        return found;
+}
+
+// Attaches the hooks of a manifest
+// NOTE: `live` is false when the JVM is still starting up (Agent_OnLoad),
+//       in which case no class can be looked up yet
+static jint
+attach_manifest(JavaVM *jvm, const char *options, bool live)
+{
+        std::vector<manifest_entry_t> entries;
+        std::unordered_map<std::string, jclass> loaded_classes;
+        std::vector<jnihook_attach_t> native_hooks;
+        std::vector<size_t> native_lines; // Manifest line of each native hook
+        std::vector<std::pair<manifest_entry_t, jnihook_attach_t>> deferred_hooks;
+        jvmtiEnv *jvmti;
+        size_t failed = 0;
+
+        if (!options || strlen(options) == 0) {
+                AGENT_ERR("ERR: Missing hook manifest, use -agentpath:<agent>=<manifest>\n");
+                return JNI_ERR;
+        }
+
+        if (!parse_manifest(options, entries))
+                return JNI_ERR;
+
+        if (!g_initialized) {
+                if (auto result = JNIHook_Init(jvm); result != JNIHOOK_OK) {
+                        AGENT_ERR("ERR: Failed to initialize JNIHook: %d\n", result);
+                        return JNI_ERR;
+                }
+                g_initialized = true;
+        }
+
+        if (live) {
+                if (jvm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION_1_2) != JNI_OK) {
+                        AGENT_ERR("ERR: Failed to get JVMTI\n");
+                        return JNI_ERR;
+                }
+
+                loaded_classes = find_loaded_classes(jvmti, entries);
+        }
+
+        for (auto &entry : entries) {
+                jnihook_result_t result = JNIHOOK_OK;
+                jmethodID *original = NULL;
+
+                void *native_hook_method = find_symbol(entry.library, entry.symbol);
+                if (!native_hook_method) {
+                        AGENT_ERR("ERR: Symbol '%s' not found in library '%s' (line %zu)\n", entry.symbol.c_str(), entry.library.c_str(), entry.line);
+                        ++failed;
+                        continue;
+                }
+
+                if (entry.original.length() > 0) {
+                        original = reinterpret_cast<jmethodID *>(find_symbol(entry.library, entry.original));
+                        if (!original) {
+                                AGENT_ERR("ERR: Symbol '%s' not found in library '%s' (line %zu)\n", entry.original.c_str(), entry.library.c_str(), entry.line);
+                                ++failed;
+                                continue;
+                        }
+                }
+
+                auto clazz = loaded_classes.find(entry.class_name);
+                if (clazz == loaded_classes.end()) {
+                        if (entry.type != "native") {
+                                AGENT_ERR("ERR: Class '%s' is not loaded, only native hooks can be deferred (line %zu)\n", entry.class_name.c_str(), entry.line);
+                                ++failed;
+                                continue;
+                        }
+
+                        result = JNIHook_AttachDeferred(entry.class_name.c_str(), entry.method_name.c_str(), entry.signature.c_str(),
+                                                        native_hook_method, original);
+                        if (result == JNIHOOK_OK && live)
+                                deferred_hooks.push_back({ entry, jnihook_attach_t { NULL, native_hook_method, original } });
+                } else {
+                        jmethodID method = find_method(jvmti, clazz->second, entry.method_name, entry.signature);
+                        if (!method) {
+                                AGENT_ERR("ERR: Method '%s -> %s' not found in class '%s' (line %zu)\n", entry.method_name.c_str(), entry.signature.c_str(), entry.class_name.c_str(), entry.line);
+                                ++failed;
+                                continue;
+                        }
+
+                        // Native hooks are attached in a single batch below
+                        if (entry.type == "native") {
+                                native_hooks.push_back(jnihook_attach_t { method, native_hook_method, original });
+                                native_lines.push_back(entry.line);
+                        } else if (entry.type == "guarded")
+                                result = JNIHook_AttachGuarded(method, native_hook_method, original, entry.enabled ? JNI_TRUE : JNI_FALSE);
+                        else
+                                result = JNIHook_BytecodeAttach(method, native_hook_method, original, entry.offset);
+                }
+
+                if (result != JNIHOOK_OK) {
+                        AGENT_ERR("ERR: Failed to attach hook (line %zu): %d\n", entry.line, result);
+                        ++failed;
+                }
+        }
+
+        // The classes that were loaded after the lookup above, but before their hooks
+        // were deferred, are not hooked by JNIHook, so they are hooked right away
+        // NOTE: Classes that were loaded after their hooks were deferred are looked up
+        //       too, and attaching the same hook again doesn't redefine them
+        if (deferred_hooks.size() > 0) {
+                std::vector<manifest_entry_t> deferred_entries;
+
+                for (auto &[entry, _hook] : deferred_hooks)
+                        deferred_entries.push_back(entry);
+                loaded_classes = find_loaded_classes(jvmti, deferred_entries);
+
+                for (auto &[entry, hook] : deferred_hooks) {
+                        auto clazz = loaded_classes.find(entry.class_name);
+                        if (clazz == loaded_classes.end())
+                                continue;
+
+                        // A class that isn't prepared yet gets its native method registered by JNIHook
+                        jint status;
+                        if (jvmti->GetClassStatus(clazz->second, &status) != JVMTI_ERROR_NONE ||
+                            !(status & JVMTI_CLASS_STATUS_PREPARED))
+                                continue;
+
+                        hook.method = find_method(jvmti, clazz->second, entry.method_name, entry.signature);
+                        if (!hook.method) {
+                                AGENT_ERR("ERR: Method '%s -> %s' not found in class '%s' (line %zu)\n", entry.method_name.c_str(), entry.signature.c_str(), entry.class_name.c_str(), entry.line);
+                                ++failed;
+                                continue;
+                        }
+
+                        native_hooks.push_back(hook);
+                        native_lines.push_back(entry.line);
+                }
+        }
+
+        // A failed batch is rolled back completely, so its hooks are retried one by one
+        // to attach the ones that don't fail
+        if (native_hooks.size() > 0) {
+                if (auto result = JNIHook_AttachMany(native_hooks.data(), native_hooks.size()); result != JNIHOOK_OK) {
+                        AGENT_ERR("WARN: Failed to attach %zu native hook(s) at once: %d, retrying them separately\n", native_hooks.size(), result);
+
+                        for (size_t i = 0; i < native_hooks.size(); ++i) {
+                                auto &hook = native_hooks[i];
+
+                                if (result = JNIHook_Attach(hook.method, hook.native_hook_method, hook.original_method); result != JNIHOOK_OK) {
+                                        AGENT_ERR("ERR: Failed to attach hook (line %zu): %d\n", native_lines[i], result);
+                                        ++failed;
+                                }
+                        }
+                }
+        }
+
+        if (failed > 0)
+                AGENT_ERR("WARN: %zu of %zu hook(s) from the manifest failed\n", failed, entries.size());
+
+        // A hook that failed doesn't stop the JVM from starting
+        return JNI_OK;
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Agent_OnLoad(JavaVM *vm, char *options, void *reserved)
+{
+        return attach_manifest(vm, options, false);
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Agent_OnAttach(JavaVM *vm, char *options, void *reserved)
+{
+        return attach_manifest(vm, options, true);
+}
@@ -46,12 +46,103 @@ typedef enum {
 	JNIHOOK_ERR_CLASS_FILE_CACHE,
 	JNIHOOK_ERR_JAVA_EXCEPTION,
 	JNIHOOK_ERR_CLASS_FILE_FORMAT,
+	JNIHOOK_ERR_INVALID_ARGUMENT,
 
 	JNIHOOK_ERR_UNKNOWN
 } jnihook_result_t;
 
+typedef enum {
+	JNIHOOK_SUSPEND_ALL = 0,  /* Suspend every other Java thread (default) */
+	JNIHOOK_SUSPEND_TARGETED, /* Only suspend the threads running code of the classes being redefined */
+	JNIHOOK_SUSPEND_NONE,     /* Don't suspend any thread, rely on the safepoint of the class redefinition */
+
+	JNIHOOK_SUSPEND_POLICY_COUNT
+} jnihook_suspend_policy_t;
+
+typedef struct {
+	jlong count;    /* Number of attach operations */
+	jlong total_ns; /* Cumulative latency */
+	jlong max_ns;   /* Highest latency */
+	jlong last_ns;  /* Latency of the last attach operation */
+} jnihook_latency_t;
+
+typedef struct {
+	jmethodID method;           /* The Java method being hooked */
+	void *native_hook_method;   /* The native method that will be called by the JVM instead of `method` */
+	jmethodID *original_method; /* (optional) Receives a copy of the original (unhooked) method */
+} jnihook_attach_t;
+
+typedef enum {
+	JNIHOOK_FILTER_EQ = 0,    /* The argument is equal to the value (primitives and strings) */
+	JNIHOOK_FILTER_NE,        /* The argument is not equal to the value (primitives and strings) */
+	JNIHOOK_FILTER_LT,        /* The argument is lower than the value (primitives) */
+	JNIHOOK_FILTER_LE,        /* The argument is lower than or equal to the value (primitives) */
+	JNIHOOK_FILTER_GT,        /* The argument is greater than the value (primitives) */
+	JNIHOOK_FILTER_GE,        /* The argument is greater than or equal to the value (primitives) */
+	JNIHOOK_FILTER_NULL,      /* The argument is null (objects and arrays) */
+	JNIHOOK_FILTER_NOT_NULL,  /* The argument is not null (objects and arrays) */
+
+	JNIHOOK_FILTER_OP_COUNT
+} jnihook_filter_op_t;
+
+typedef struct {
+	jint arg;               /* Index of the argument, 0 being the first one after `this` */
+	jnihook_filter_op_t op; /* Comparison of the argument with the value */
+	jvalue value;           /* Value of primitive arguments, in the member matching their type */
+	const char *string;     /* Value of `java.lang.String` arguments, in modified UTF-8 (must not be NULL) */
+} jnihook_filter_t;
+
+typedef struct {
+	jlong hits;      /* Redefinitions that reused previously patched class bytes */
+	jlong misses;    /* Redefinitions that had to patch and serialize the class */
+	jlong evictions; /* Entries dropped to stay within the budget */
+	jlong entries;   /* Number of cached entries */
+	jlong bytes;     /* Size of the cached entries */
+	jlong budget;    /* Maximum size of the cached entries */
+} jnihook_patch_cache_stats_t;
+
+typedef struct {
+	jlong cached_classes;      /* Classes whose original bytes are cached */
+	jlong original_bytes;      /* Size of the cached original class bytes */
+	jlong parsed_classes;      /* Original classes in the parsed class cache */
+	jlong parsed_bytes;        /* Approximate size of the parsed class cache (see `JNIHook_SetClassCacheBudget`) */
+	jlong patched_classes;     /* Last patched versions of classes in the parsed class cache, kept for incremental patching */
+	jlong patch_cache_bytes;   /* Size of the patched class cache (see `JNIHook_GetPatchCacheStats`) */
+
+	jlong native_hooks;        /* Hooks that replace a method with a native method */
+	jlong init_hooks;          /* Hooks of constructors */
+	jlong clinit_hooks;        /* Hooks of static class initializers */
+	jlong bytecode_hooks;      /* Mid-function hooks */
+	jlong guarded_hooks;       /* Hooks that can be toggled without a redefinition */
+
+	jlong redefinitions;       /* Number of `RedefineClasses` calls */
+	jlong redefined_classes;   /* Number of classes redefined by those calls */
+	jlong cache_class_ns;      /* Cumulative time spent caching classes */
+	jlong reapply_classes_ns;  /* Cumulative time spent patching and redefining classes */
+	jlong redefine_classes_ns; /* Cumulative time spent in `RedefineClasses` */
+
+	jlong disk_cache_hits;     /* Patched classes loaded from the disk cache */
+	jlong disk_cache_misses;   /* Patched classes that were not in the disk cache */
+
+	jlong probe_hooks;         /* Hooks that call native probes around the original code */
+	jlong counter_hooks;       /* Hooks that only count the calls of a method */
+	jlong sampled_hooks;       /* Hooks that only call the native method once every N calls */
+	jlong filtered_hooks;      /* Hooks that only call the native method when the arguments match */
+} jnihook_stats_t;
+
+/* Handle of an asynchronous attach or detach operation */
+typedef struct jnihook_async_t jnihook_async_t;
+
+/* Called on the JNIHook worker thread when an asynchronous operation completes */
+typedef void (JNIHOOK_CALL *jnihook_async_callback_t)(jnihook_async_t *handle, jnihook_result_t result, void *user_data);
+
 /**
  * Initializes the JNIHook library
+ * NOTE: The JVMTI ClassFileLoadHook event stays enabled until `JNIHook_Shutdown`.
+ *       Classes without hooks are rejected by a prefilter without further work,
+ *       and no Java code is called from the hook.
+ *       When called from `Agent_OnLoad`, it also requests the capabilities to patch
+ *       classes that load early in the JVM startup (see `agent/agent.cpp`).
  *
  * @param jvm The Java Virtual Machine that will be instrumented by JNIHook
  * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
@@ -86,6 +177,295 @@ JNIHook_Attach(jmethodID method, void *native_hook_method, jmethodID *original_m
 JNIHOOK_API jnihook_result_t JNIHOOK_CALL
 JNIHook_BytecodeAttach(jmethodID method, void *native_hook_method, jmethodID *original_method, size_t offset);
 
+/**
+ * Attaches a hook to a Java method of a class that has not been loaded yet
+ * NOTE: The class is patched while it is being loaded, so no redefinition is needed.
+ *       The native method is registered (and `original_method` is written) once the
+ *       class is prepared. Every class loaded with `class_name` is hooked, whatever
+ *       its class loader is, and `original_method` receives the original method of
+ *       the last one. Classes that are already loaded must be hooked with `JNIHook_Attach`.
+ *       The hook is kept until `JNIHook_DetachDeferred` is called.
+ *
+ * @param class_name The name of the class, e.g. "java/lang/String" or "java.lang.String"
+ * @param method_name The name of the Java method being hooked
+ * @param method_signature The signature of the Java method being hooked, e.g. "(I)V"
+ * @param native_hook_method The native method that will be called by the JVM instead of the method
+ * @param original_method (optional) Output variable that will receive a copy of the original (unhooked) method
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachDeferred(const char *class_name, const char *method_name, const char *method_signature,
+                       void *native_hook_method, jmethodID *original_method);
+
+/**
+ * Removes a hook attached with `JNIHook_AttachDeferred`, so that the classes
+ * loaded from now on with `class_name` are not hooked anymore
+ * NOTE: The classes that were already loaded keep the hook, which can be removed
+ *       from each of them with `JNIHook_Detach`.
+ *
+ * @param class_name The name of the class, e.g. "java/lang/String" or "java.lang.String"
+ * @param method_name The name of the hooked Java method
+ * @param method_signature The signature of the hooked Java method, e.g. "(I)V"
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure (JNIHOOK_ERR_INVALID_ARGUMENT
+ *         if there is no such deferred hook).
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachDeferred(const char *class_name, const char *method_name, const char *method_signature);
+
+/**
+ * Attaches a guarded hook to a Java method, which can be enabled and disabled
+ * without redefining the class (see `JNIHook_SetHookEnabled`)
+ * NOTE: The hooked method checks a 'static volatile boolean' guard, that lives in a
+ *       synthetic holder class defined next to the hooked class, and calls either
+ *       the native hook method or the original method. Constructors, class initializers,
+ *       native and abstract methods, and methods of interfaces can't have guarded hooks.
+ *
+ * @param method The Java method being hooked
+ * @param native_hook_method The native method that will be called by the JVM instead of `method` while the hook is enabled
+ * @param original_method (optional) Output variable that will receive a copy of the original (unhooked) method
+ * @param enabled The initial state of the hook
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachGuarded(jmethodID method, void *native_hook_method, jmethodID *original_method, jboolean enabled);
+
+/**
+ * Attaches a probe hook to a Java method, which calls native probes when the
+ * method is entered and when it returns, while its original code runs inline
+ * NOTE: Unlike the other hooks, the probes only observe the method, so the original
+ *       method doesn't have to be called back through JNI. The exit probe is called
+ *       before every return of the method, and before every athrow that is outside
+ *       of the ranges of its exception handlers. It isn't called when an exception
+ *       thrown by a method it calls goes through it, nor when an exception thrown
+ *       inside the range of a handler leaves it. Either probe can be NULL.
+ *       For instance methods, the exit probe receives the local variable 0 as the
+ *       object, which is only `this` if the method never stores into it (javac never
+ *       does, but other bytecode generators may).
+ *       Constructors, class initializers, native and abstract methods, and methods
+ *       of interfaces can't have probe hooks.
+ *       Probe signatures are as follows:
+ *           void (*entry_probe)(JNIEnv *env, jobject objectOrClass, ...);
+ *           void (*exit_probe)(JNIEnv *env, jobject objectOrClass);
+ *
+ * @param method The Java method being probed
+ * @param entry_probe (optional) The native method called with the arguments of `method` when it is entered
+ * @param exit_probe (optional) The native method called when `method` returns or throws
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachProbe(jmethodID method, void *entry_probe, void *exit_probe);
+
+/**
+ * Attaches a sampled hook to a Java method, which only calls the native hook method
+ * once every `period` calls, and runs the original method for the other calls
+ * NOTE: Like a guarded hook, the hooked method forwards its calls to a synthetic holder
+ *       class, which counts them down without leaving Java. The countdown is shared by
+ *       the threads without synchronization, so the sampling is approximate under
+ *       contention. The period can be changed without redefining the class (see
+ *       `JNIHook_SetSamplePeriod`). The same methods as with `JNIHook_AttachGuarded`
+ *       can't have sampled hooks.
+ *
+ * @param method The Java method being hooked
+ * @param native_hook_method The native method that will be called by the JVM instead of `method` for the sampled calls
+ * @param original_method (optional) Output variable that will receive a copy of the original (unhooked) method
+ * @param period The number of calls per call of the native hook method (1 calls it every time)
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachSampled(jmethodID method, void *native_hook_method, jmethodID *original_method, jint period);
+
+/**
+ * Changes the sampling period of a sampled hook
+ * NOTE: This only sets fields of the holder class, so the class is not redefined
+ *
+ * @param method The method hooked by `JNIHook_AttachSampled`
+ * @param period The new number of calls per call of the native hook method
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetSamplePeriod(jmethodID method, jint period);
+
+/**
+ * Attaches a filtered hook to a Java method, which only calls the native hook method
+ * when every filter matches the arguments of the call, and runs the original method otherwise
+ * NOTE: Like a guarded hook, the hooked method forwards its calls to a synthetic holder
+ *       class, where the filters are compiled into bytecode, so the calls that don't
+ *       match never leave Java. Attaching filters on the same arguments with the same
+ *       comparisons again only changes their values, without redefining the class.
+ *       Floating point comparisons follow Java (NaN only matches `JNIHOOK_FILTER_NE`).
+ *       The same methods as with `JNIHook_AttachGuarded` can't have filtered hooks.
+ *
+ * @param method The Java method being hooked
+ * @param native_hook_method The native method that will be called by the JVM instead of `method` for the matching calls
+ * @param original_method (optional) Output variable that will receive a copy of the original (unhooked) method
+ * @param filters The conditions that the arguments must all match
+ * @param n The number of filters
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachFiltered(jmethodID method, void *native_hook_method, jmethodID *original_method,
+                       const jnihook_filter_t *filters, size_t n);
+
+/**
+ * Attaches a counter hook to a Java method, which counts its calls without any native code
+ * NOTE: The hooked method increments a counter that lives in a synthetic holder class
+ *       defined next to the hooked class, and then runs its original code, so the
+ *       calls never leave Java and stay inlinable by the JIT. A plain counter is a
+ *       'static long' incremented without synchronization, so concurrent calls may be
+ *       lost, while a striped counter is a 'LongAdder', which is exact and scales
+ *       on contended methods at a slightly higher cost per call.
+ *       The counter keeps its value if the method is detached and hooked again.
+ *       Native and abstract methods can't have counter hooks.
+ *
+ * @param method The Java method being counted
+ * @param striped Whether the counter is a 'LongAdder' rather than a plain 'long'
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachCounter(jmethodID method, jboolean striped);
+
+/**
+ * Reads the counters of many methods hooked by `JNIHook_AttachCounter`
+ * NOTE: The plain counters are read with 'GetStaticLongField', and the striped
+ *       ones are summed. Methods without a counter hook get a count of -1.
+ *
+ * @param methods The methods whose counters are read
+ * @param n The number of methods
+ * @param counts Output array that receives the count of each method
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetCounters(const jmethodID *methods, size_t n, jlong *counts);
+
+/**
+ * Enables or disables a guarded hook
+ * NOTE: This only sets the guard field of the hook, so the class is not redefined
+ *
+ * @param method The method hooked by `JNIHook_AttachGuarded`
+ * @param enabled The new state of the hook
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetHookEnabled(jmethodID method, jboolean enabled);
+
+/**
+ * Attaches multiple hooks at once
+ * NOTE: Every affected class is patched and redefined only once, and the
+ *       other threads are suspended a single time for the whole batch.
+ *       If any hook fails to be attached, none of them are kept.
+ *
+ * @param reqs Array of hooks to attach (see `JNIHook_Attach`)
+ * @param n Number of elements in `reqs`
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachMany(const jnihook_attach_t *reqs, size_t n);
+
+/**
+ * Attaches multiple hooks at once, in the background
+ * NOTE: The operations are run by an internal worker thread, attached to the JVM.
+ *       Operations queued within a short window (see `JNIHook_SetAsyncCoalesceWindow`)
+ *       are coalesced, so that every affected class is redefined only once. If a
+ *       coalesced batch fails, its operations are retried separately.
+ *       The `original_method` outputs are written by the worker thread, so they
+ *       must stay valid until the operation completes.
+ *       Completion callbacks must not call `JNIHook_Shutdown`.
+ *
+ * @param reqs Array of hooks to attach (see `JNIHook_AttachMany`)
+ * @param n Number of elements in `reqs`
+ * @param callback (optional) Function called once the operation completes
+ * @param user_data (optional) Value passed to `callback`
+ * @param handle (optional) Output variable that will receive a handle to poll or wait on the
+ *               operation, which must be released with `JNIHook_ReleaseAsync`
+ * @return JNIHOOK_OK if the operation was queued, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachAsync(const jnihook_attach_t *reqs, size_t n, jnihook_async_callback_t callback,
+                    void *user_data, jnihook_async_t **handle);
+
+/**
+ * Detaches multiple hooks at once, in the background (see `JNIHook_AttachAsync`)
+ *
+ * @param methods Array of methods being unhooked
+ * @param n Number of elements in `methods`
+ * @param callback (optional) Function called once the operation completes
+ * @param user_data (optional) Value passed to `callback`
+ * @param handle (optional) Output variable that will receive a handle to poll or wait on the
+ *               operation, which must be released with `JNIHook_ReleaseAsync`
+ * @return JNIHOOK_OK if the operation was queued, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachAsync(const jmethodID *methods, size_t n, jnihook_async_callback_t callback,
+                    void *user_data, jnihook_async_t **handle);
+
+/**
+ * Checks if an asynchronous operation has completed, without blocking
+ *
+ * @param handle The handle of the operation
+ * @param done Output variable that will receive whether the operation has completed
+ * @param result (optional) Output variable that will receive the result of the operation, if it has completed
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_PollAsync(jnihook_async_t *handle, jboolean *done, jnihook_result_t *result);
+
+/**
+ * Blocks until an asynchronous operation completes
+ * NOTE: Don't wait on operations from their own completion callbacks.
+ *
+ * @param handle The handle of the operation
+ * @param result (optional) Output variable that will receive the result of the operation
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_WaitAsync(jnihook_async_t *handle, jnihook_result_t *result);
+
+/**
+ * Releases the handle of an asynchronous operation
+ * NOTE: The operation still completes if its handle is released before that.
+ *
+ * @param handle The handle of the operation
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_ReleaseAsync(jnihook_async_t *handle);
+
+/**
+ * Sets how long the worker waits for more operations before running the queued ones
+ *
+ * @param window_us The coalescing window, in microseconds (0 disables coalescing)
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetAsyncCoalesceWindow(jlong window_us);
+
+/**
+ * Caches the original bytes of multiple classes ahead of time, so that
+ * attaching hooks to them later doesn't need to retransform them
+ * NOTE: All the classes that aren't cached yet are retransformed with a
+ *       single `RetransformClasses` call. Unmodifiable classes are skipped.
+ *
+ * @param classes Array of classes to cache
+ * @param n Number of elements in `classes`
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_PrecacheClasses(const jclass *classes, jint n);
+
+/**
+ * Caches the original bytes of classes as they get loaded, so that attaching
+ * hooks to them later doesn't need to retransform them
+ * NOTE: Every loaded class whose name starts with one of the prefixes is cached,
+ *       which may take a lot of memory for broad prefixes. Classes that were
+ *       already loaded are not affected (see `JNIHook_PrecacheClasses`).
+ *
+ * @param prefixes Array of class name prefixes, e.g. "com/example/" or "com.example."
+ * @param n Number of elements in `prefixes` (0 disables passive caching)
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPassiveCaching(const char *const *prefixes, size_t n);
+
 /**
  * Detaches a hook from a Java method
  *
@@ -95,6 +475,131 @@ JNIHook_BytecodeAttach(jmethodID method, void *native_hook_method, jmethodID *or
 JNIHOOK_API jnihook_result_t JNIHOOK_CALL
 JNIHook_Detach(jmethodID method);
 
+/**
+ * Detaches the hooks of multiple Java methods at once
+ * NOTE: Every affected class is redefined only once for the whole batch.
+ *
+ * @param methods Array of methods being unhooked
+ * @param n Number of elements in `methods`
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachMany(const jmethodID *methods, size_t n);
+
+/**
+ * Sets which threads get suspended while hooks are being attached
+ * NOTE: Every policy suspends the threads with a single `SuspendThreadList` call.
+ *       `JNIHOOK_SUSPEND_TARGETED` inspects the stacks of the other threads and only
+ *       suspends the ones that have frames from the classes being redefined.
+ *       `JNIHOOK_SUSPEND_NONE` doesn't suspend anything; the redefinition itself
+ *       still happens at a VM safepoint, but other threads may call the hooked
+ *       methods before their native methods are registered.
+ *
+ * @param policy The suspend policy used by the next attach operations
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetSuspendPolicy(jnihook_suspend_policy_t policy);
+
+/**
+ * Gets the latency of the attach operations that used a suspend policy
+ *
+ * @param policy The suspend policy to get the latency of
+ * @param latency Output variable that will receive the latency information
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetAttachLatency(jnihook_suspend_policy_t policy, jnihook_latency_t *latency);
+
+/**
+ * Sets the memory budget of the patched class cache
+ * NOTE: The bytes of every patched class are cached by the set of hooks that
+ *       were applied to it, so going back to a previously seen set of hooks
+ *       skips patching and serializing the class. Copies of a class that are
+ *       defined from the same bytes by different class loaders share their
+ *       entries, so they are only patched once. The least recently used
+ *       entries are evicted when the budget is exceeded. A budget of 0
+ *       disables the cache.
+ *
+ * @param budget The maximum size (in bytes) of the cached classes
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPatchCacheBudget(size_t budget);
+
+/**
+ * Sets the memory budget of the parsed class cache
+ * NOTE: The original bytes of every hooked class are kept, and they are only
+ *       parsed when the class needs to be patched. The parsed forms are cached,
+ *       and the least recently used ones are evicted when the budget is exceeded,
+ *       to be parsed again on demand. Their size is approximated by the size of
+ *       the original class bytes. The last patched version of each class, which
+ *       lets new hooks be applied without patching the whole class again, is kept
+ *       within the same budget, with the size of its patched bytes. The budget is
+ *       unlimited by default, and a budget of 0 parses and patches the classes from
+ *       scratch every time.
+ *
+ * @param budget The maximum size (in bytes) of the parsed classes
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetClassCacheBudget(size_t budget);
+
+/**
+ * Sets how many threads patch the classes of a batch of hooks
+ * NOTE: When many classes are hooked at once (e.g. through `JNIHook_AttachMany`),
+ *       the classes that aren't in the patched class caches are parsed, patched
+ *       and serialized in parallel, before all of them are redefined at once.
+ *       The attaching thread is one of the threads. By default (0), there is one
+ *       thread per processor, and 1 patches the classes on the attaching thread.
+ *
+ * @param threads The maximum number of threads, or 0 for one per processor
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPatchThreads(size_t threads);
+
+/**
+ * Keeps the patched classes in a directory, so that later runs with the same
+ * classes and hooks can skip parsing, patching and serializing them
+ * NOTE: Entries are keyed by a hash of the original class bytes and the set of
+ *       hooks applied to them, and read through memory mappings. The directory
+ *       also keeps the suffix of the names that JNIHook generates, which is only
+ *       picked up if this is called before the first hook is attached.
+ *       Holder classes are named after the hooked method and the kind of hook,
+ *       so the classes patched for holder-based hooks are reused too, unless
+ *       the same holder is defined twice in a run (e.g. after JNIHook_Shutdown).
+ *       The directory is never cleaned up by JNIHook. It can be shared by
+ *       concurrent processes.
+ *
+ * @param directory The cache directory, created if needed (NULL disables the disk cache)
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetDiskCacheDirectory(const char *directory);
+
+/**
+ * Gets the statistics of the patched class cache
+ *
+ * @param stats Output variable that will receive the cache statistics
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetPatchCacheStats(jnihook_patch_cache_stats_t *stats);
+
+/**
+ * Gets the memory held by JNIHook, the number of hooks of each type, and
+ * how much time was spent caching, patching and redefining classes
+ * NOTE: The counters are cumulative since the library was loaded. The memory
+ *       of the parsed classes is not exposed by jnif, so it is approximated
+ *       by the size of their original bytes.
+ *
+ * @param stats Output variable that will receive the statistics
+ * @return JNIHOOK_OK on success, JNIHOOK_ERR_* on failure.
+ */
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetStats(jnihook_stats_t *stats);
+
 /**
  * Detaches every hook and shuts down JNIHook
  */
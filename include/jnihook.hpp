@@ -1,6 +1,8 @@
 #include "jnihook.h"
 #include <functional>
 #include <expected>
+#include <span>
+#include <vector>
 
 namespace jnihook {
         typedef jnihook_result_t result_t;
@@ -26,12 +28,143 @@ namespace jnihook {
                 return orig_method;
         }
 
+        template <typename T>
+        inline std::expected<jmethodID, result_t>
+        attach_guarded(jmethodID method, T *native_hook_method, bool enabled = true)
+        {
+                jmethodID orig_method;
+                result_t result = JNIHook_AttachGuarded(method,
+                                                        reinterpret_cast<void *>(native_hook_method),
+                                                        &orig_method, enabled ? JNI_TRUE : JNI_FALSE);
+
+                if (result != JNIHOOK_OK)
+                        return std::unexpected(result);
+
+                return orig_method;
+        }
+
+        inline result_t
+        set_hook_enabled(jmethodID method, bool enabled)
+        {
+                return JNIHook_SetHookEnabled(method, enabled ? JNI_TRUE : JNI_FALSE);
+        }
+
+        template <typename T>
+        inline std::expected<jmethodID, result_t>
+        attach_sampled(jmethodID method, T *native_hook_method, jint period)
+        {
+                jmethodID orig_method;
+                result_t result = JNIHook_AttachSampled(method,
+                                                        reinterpret_cast<void *>(native_hook_method),
+                                                        &orig_method, period);
+
+                if (result != JNIHOOK_OK)
+                        return std::unexpected(result);
+
+                return orig_method;
+        }
+
+        inline result_t
+        set_sample_period(jmethodID method, jint period)
+        {
+                return JNIHook_SetSamplePeriod(method, period);
+        }
+
+        template <typename T>
+        inline std::expected<jmethodID, result_t>
+        attach_filtered(jmethodID method, T *native_hook_method, std::span<const jnihook_filter_t> filters)
+        {
+                jmethodID orig_method;
+                result_t result = JNIHook_AttachFiltered(method,
+                                                         reinterpret_cast<void *>(native_hook_method),
+                                                         &orig_method, filters.data(), filters.size());
+
+                if (result != JNIHOOK_OK)
+                        return std::unexpected(result);
+
+                return orig_method;
+        }
+
+        template <typename T, typename U>
+        inline result_t
+        attach_probe(jmethodID method, T *entry_probe, U *exit_probe)
+        {
+                return JNIHook_AttachProbe(method, reinterpret_cast<void *>(entry_probe),
+                                           reinterpret_cast<void *>(exit_probe));
+        }
+
+        inline result_t
+        attach_counter(jmethodID method, bool striped = false)
+        {
+                return JNIHook_AttachCounter(method, striped ? JNI_TRUE : JNI_FALSE);
+        }
+
+        inline std::expected<std::vector<jlong>, result_t>
+        get_counters(std::span<const jmethodID> methods)
+        {
+                std::vector<jlong> counts(methods.size());
+                result_t result = JNIHook_GetCounters(methods.data(), methods.size(), counts.data());
+
+                if (result != JNIHOOK_OK)
+                        return std::unexpected(result);
+
+                return counts;
+        }
+
+        template <typename T>
+        inline result_t
+        attach_deferred(const char *class_name, const char *method_name, const char *method_signature,
+                        T *native_hook_method, jmethodID *original_method = nullptr)
+        {
+                return JNIHook_AttachDeferred(class_name, method_name, method_signature,
+                                              reinterpret_cast<void *>(native_hook_method),
+                                              original_method);
+        }
+
+        inline result_t
+        detach_deferred(const char *class_name, const char *method_name, const char *method_signature)
+        {
+                return JNIHook_DetachDeferred(class_name, method_name, method_signature);
+        }
+
+        inline result_t
+        attach_many(std::span<const jnihook_attach_t> reqs)
+        {
+                return JNIHook_AttachMany(reqs.data(), reqs.size());
+        }
+
+        inline result_t
+        attach_async(std::span<const jnihook_attach_t> reqs, jnihook_async_callback_t callback = nullptr,
+                     void *user_data = nullptr, jnihook_async_t **handle = nullptr)
+        {
+                return JNIHook_AttachAsync(reqs.data(), reqs.size(), callback, user_data, handle);
+        }
+
+        inline result_t
+        precache_classes(std::span<const jclass> classes)
+        {
+                return JNIHook_PrecacheClasses(classes.data(), static_cast<jint>(classes.size()));
+        }
+
         inline result_t
         detach(jmethodID method)
         {
                 return JNIHook_Detach(method);
         }
 
+        inline result_t
+        detach_many(std::span<const jmethodID> methods)
+        {
+                return JNIHook_DetachMany(methods.data(), methods.size());
+        }
+
+        inline result_t
+        detach_async(std::span<const jmethodID> methods, jnihook_async_callback_t callback = nullptr,
+                     void *user_data = nullptr, jnihook_async_t **handle = nullptr)
+        {
+                return JNIHook_DetachAsync(methods.data(), methods.size(), callback, user_data, handle);
+        }
+
         inline result_t
         shutdown()
         {
@@ -0,0 +1,88 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLOOM_HPP_
+#define _BLOOM_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Bloom filter over strings that can be queried and extended without locks
+// NOTE: Keys can't be removed, so the filter only grows until it is cleared.
+//       A positive answer must be confirmed against an exact set.
+template <size_t Bits, size_t Hashes>
+class BloomFilter {
+        static_assert(Bits > 0 && Bits % 64 == 0, "Bits must be a multiple of 64");
+private:
+        std::atomic<uint64_t> words[Bits / 64] = {};
+
+        // FNV-1a, split into the two halves used for double hashing
+        static inline void hash(std::string_view key, uint64_t &h1, uint64_t &h2)
+        {
+                uint64_t h = 14695981039346656037ULL;
+
+                for (auto c : key) {
+                        h ^= static_cast<uint8_t>(c);
+                        h *= 1099511628211ULL;
+                }
+
+                h1 = h & 0xffffffff;
+                h2 = (h >> 32) | 1; // Odd, so that the probes don't repeat early
+        }
+
+public:
+        void add(std::string_view key)
+        {
+                uint64_t h1, h2;
+
+                hash(key, h1, h2);
+                for (size_t i = 0; i < Hashes; ++i) {
+                        auto bit = (h1 + i * h2) % Bits;
+                        words[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_release);
+                }
+        }
+
+        // Returns false if the key was never added, true if it may have been
+        bool may_contain(std::string_view key) const
+        {
+                uint64_t h1, h2;
+
+                hash(key, h1, h2);
+                for (size_t i = 0; i < Hashes; ++i) {
+                        auto bit = (h1 + i * h2) % Bits;
+                        if ((words[bit / 64].load(std::memory_order_acquire) & (1ULL << (bit % 64))) == 0)
+                                return false;
+                }
+
+                return true;
+        }
+
+        void clear()
+        {
+                for (auto &word : words)
+                        word.store(0, std::memory_order_release);
+        }
+};
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "diskcache.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <system_error>
+#ifdef _WIN32
+        #include <windows.h>
+#else
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <unistd.h>
+#endif
+
+/* entry header */
+static constexpr char DISK_CACHE_MAGIC[8] = { 'J', 'N', 'I', 'H', 'O', 'O', 'K', 'C' };
+static constexpr uint32_t DISK_CACHE_VERSION = 1; // Bump when the patched classes change
+
+typedef struct disk_cache_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t size;
+} disk_cache_header_t;
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+        void *base = nullptr;
+        size_t length = 0;
+public:
+        MappedFile(const std::string &path)
+        {
+#ifdef _WIN32
+                LARGE_INTEGER file_size;
+
+                file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+                        return;
+
+                mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (!mapping)
+                        return;
+
+                base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if (base)
+                        length = static_cast<size_t>(file_size.QuadPart);
+#else
+                struct stat st;
+                int fd = ::open(path.c_str(), O_RDONLY);
+
+                if (fd < 0)
+                        return;
+
+                if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                        void *addr = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (addr != MAP_FAILED) {
+                                base = addr;
+                                length = static_cast<size_t>(st.st_size);
+                        }
+                }
+
+                // The mapping stays valid after the file is closed
+                ::close(fd);
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+                if (base)
+                        UnmapViewOfFile(base);
+                if (mapping)
+                        CloseHandle(mapping);
+                if (file != INVALID_HANDLE_VALUE)
+                        CloseHandle(file);
+#else
+                if (base)
+                        munmap(base, length);
+#endif
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        inline const uint8_t *data() const { return static_cast<const uint8_t *>(base); }
+        inline size_t size() const { return length; }
+};
+
+std::string
+DiskCache::get_path(const std::string &key) const
+{
+        return (std::filesystem::path(directory) / (key + ".bin")).string();
+}
+
+bool
+DiskCache::open(const std::string &path)
+{
+        std::error_code ec;
+
+        if (path.length() == 0)
+                return false;
+
+        std::filesystem::create_directories(path, ec);
+        if (ec || !std::filesystem::is_directory(path, ec))
+                return false;
+
+        directory = path;
+        return true;
+}
+
+void
+DiskCache::close()
+{
+        directory.clear();
+}
+
+bool
+DiskCache::get(const std::string &key, std::vector<uint8_t> &data) const
+{
+        disk_cache_header_t header;
+
+        if (!is_open())
+                return false;
+
+        MappedFile file(get_path(key));
+        if (!file.data() || file.size() < sizeof(header))
+                return false;
+
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, DISK_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != DISK_CACHE_VERSION ||
+            header.size != file.size() - sizeof(header))
+                return false;
+
+        data.assign(file.data() + sizeof(header), file.data() + file.size());
+        return true;
+}
+
+bool
+DiskCache::put(const std::string &key, const std::vector<uint8_t> &data) const
+{
+        disk_cache_header_t header = {};
+        std::error_code ec;
+
+        if (!is_open())
+                return false;
+
+        memcpy(header.magic, DISK_CACHE_MAGIC, sizeof(header.magic));
+        header.version = DISK_CACHE_VERSION;
+        header.size = data.size();
+
+        // Other processes may be writing the same entry
+        auto path = get_path(key);
+        auto tmp_path = path + ".tmp" + std::to_string(std::random_device{}());
+        {
+                std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+                if (!file)
+                        return false;
+
+                file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+                file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+                if (!file) {
+                        file.close();
+                        std::filesystem::remove(tmp_path, ec);
+                        return false;
+                }
+        }
+
+        std::filesystem::rename(tmp_path, path, ec);
+        if (ec) {
+                std::filesystem::remove(tmp_path, ec);
+                return false;
+        }
+
+        return true;
+}
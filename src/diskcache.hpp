@@ -0,0 +1,54 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DISKCACHE_HPP_
+#define _DISKCACHE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Directory of cached entries that outlives the process, used to keep
+ * patched classes across restarts. Every entry is a file named after its
+ * key, with a small header that is checked before the entry is used.
+ * Entries are read through memory mappings, and written to a temporary
+ * file that is renamed into place, so concurrent processes never see
+ * partially written entries.
+ */
+class DiskCache {
+private:
+        std::string directory;
+
+        std::string get_path(const std::string &key) const;
+public:
+        // Uses `path` as the cache directory, creating it if needed
+        bool open(const std::string &path);
+        void close();
+
+        inline bool is_open() const { return directory.length() > 0; }
+
+        bool get(const std::string &key, std::vector<uint8_t> &data) const;
+        bool put(const std::string &key, const std::vector<uint8_t> &data) const;
+};
+
+#endif
@@ -0,0 +1,607 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "holder.hpp"
+#include <algorithm>
+
+/* class file constants */
+enum {
+        HOLDER_MAJOR_VERSION = 49,
+
+        HOLDER_CONSTANT_Utf8 = 1,
+        HOLDER_CONSTANT_Class = 7,
+        HOLDER_CONSTANT_Fieldref = 9,
+        HOLDER_CONSTANT_Methodref = 10,
+        HOLDER_CONSTANT_NameAndType = 12,
+
+        HOLDER_ACC_STATIC = 0x0008,
+        HOLDER_ACC_FINAL = 0x0010,
+        HOLDER_ACC_SUPER = 0x0020,
+        HOLDER_ACC_VOLATILE = 0x0040,
+        HOLDER_ACC_SYNTHETIC = 0x1000,
+};
+
+static void
+push_u2(std::vector<uint8_t> &dest, uint16_t value)
+{
+        dest.push_back(static_cast<uint8_t>(value >> 8));
+        dest.push_back(static_cast<uint8_t>(value & 0xff));
+}
+
+static void
+push_u4(std::vector<uint8_t> &dest, uint32_t value)
+{
+        push_u2(dest, static_cast<uint16_t>(value >> 16));
+        push_u2(dest, static_cast<uint16_t>(value & 0xffff));
+}
+
+bool
+ParseMethodDesc(const std::string &desc, method_desc_t &method_desc)
+{
+        size_t cursor = 1;
+
+        if (desc.size() < 3 || desc[0] != '(')
+                return false;
+
+        method_desc.params.clear();
+        while (cursor < desc.size() && desc[cursor] != ')') {
+                size_t start = cursor;
+
+                while (cursor < desc.size() && desc[cursor] == '[')
+                        ++cursor;
+
+                if (cursor >= desc.size())
+                        return false;
+
+                if (desc[cursor] == 'L') {
+                        cursor = desc.find(';', cursor);
+                        if (cursor == std::string::npos)
+                                return false;
+                }
+
+                ++cursor;
+                method_desc.params.push_back(desc.substr(start, cursor - start));
+        }
+
+        if (cursor + 1 >= desc.size())
+                return false;
+
+        method_desc.ret = desc.substr(cursor + 1);
+
+        return true;
+}
+
+uint16_t
+GetTypeSlots(const std::string &type)
+{
+        switch (type[0]) {
+        case 'V':
+                return 0;
+        case 'J':
+        case 'D':
+                return 2;
+        }
+
+        return 1;
+}
+
+uint16_t
+GetParamSlots(const method_desc_t &method_desc, bool is_static)
+{
+        uint16_t slots = is_static ? 0 : 1;
+
+        for (auto &param : method_desc.params)
+                slots += GetTypeSlots(param);
+
+        return slots;
+}
+
+uint8_t
+GetLoadOpcode(const std::string &type)
+{
+        switch (type[0]) {
+        case 'J':
+                return OP_LLOAD;
+        case 'F':
+                return OP_FLOAD;
+        case 'D':
+                return OP_DLOAD;
+        case 'L':
+        case '[':
+                return OP_ALOAD;
+        }
+
+        return OP_ILOAD;
+}
+
+uint8_t
+GetReturnOpcode(const std::string &type)
+{
+        switch (type[0]) {
+        case 'V':
+                return OP_RETURN;
+        case 'J':
+                return OP_LRETURN;
+        case 'F':
+                return OP_FRETURN;
+        case 'D':
+                return OP_DRETURN;
+        case 'L':
+        case '[':
+                return OP_ARETURN;
+        }
+
+        return OP_IRETURN;
+}
+
+void
+HolderCode::op(uint8_t opcode)
+{
+        code.push_back(opcode);
+}
+
+void
+HolderCode::op_u1(uint8_t opcode, uint8_t operand)
+{
+        code.push_back(opcode);
+        code.push_back(operand);
+}
+
+void
+HolderCode::op_u2(uint8_t opcode, uint16_t operand)
+{
+        code.push_back(opcode);
+        push_u2(code, operand);
+}
+
+size_t
+HolderCode::branch(uint8_t opcode)
+{
+        size_t position = code.size();
+
+        op_u2(opcode, 0);
+
+        return position;
+}
+
+void
+HolderCode::bind(size_t branch)
+{
+        auto offset = static_cast<int16_t>(code.size() - branch);
+
+        code[branch + 1] = static_cast<uint8_t>(static_cast<uint16_t>(offset) >> 8);
+        code[branch + 2] = static_cast<uint8_t>(static_cast<uint16_t>(offset) & 0xff);
+}
+
+uint16_t
+HolderCode::load_args(const method_desc_t &method_desc, uint16_t slot)
+{
+        uint16_t start = slot;
+
+        for (auto &param : method_desc.params) {
+                op_u1(GetLoadOpcode(param), static_cast<uint8_t>(slot));
+                slot += GetTypeSlots(param);
+        }
+
+        return slot - start;
+}
+
+HolderClass::HolderClass(const std::string &name, const std::string &super_name)
+{
+        constant_pool.push_back({}); // The constant pool starts at index 1
+        this_class = class_ref(name);
+        super_class = class_ref(super_name);
+}
+
+uint16_t
+HolderClass::add_constant(const std::string &key, std::vector<uint8_t> entry)
+{
+        if (auto it = constants.find(key); it != constants.end())
+                return it->second;
+
+        auto index = static_cast<uint16_t>(constant_pool.size());
+        constant_pool.push_back(std::move(entry));
+        constants[key] = index;
+
+        return index;
+}
+
+uint16_t
+HolderClass::utf8(const std::string &str)
+{
+        std::vector<uint8_t> entry = { HOLDER_CONSTANT_Utf8 };
+
+        push_u2(entry, static_cast<uint16_t>(str.size()));
+        entry.insert(entry.end(), str.begin(), str.end());
+
+        return add_constant("U" + str, std::move(entry));
+}
+
+uint16_t
+HolderClass::class_ref(const std::string &name)
+{
+        std::vector<uint8_t> entry = { HOLDER_CONSTANT_Class };
+
+        push_u2(entry, utf8(name));
+
+        return add_constant("C" + name, std::move(entry));
+}
+
+uint16_t
+HolderClass::name_and_type(const std::string &name, const std::string &desc)
+{
+        std::vector<uint8_t> entry = { HOLDER_CONSTANT_NameAndType };
+
+        push_u2(entry, utf8(name));
+        push_u2(entry, utf8(desc));
+
+        return add_constant("N" + name + " " + desc, std::move(entry));
+}
+
+uint16_t
+HolderClass::field_ref(const std::string &clazz, const std::string &name, const std::string &desc)
+{
+        std::vector<uint8_t> entry = { HOLDER_CONSTANT_Fieldref };
+
+        push_u2(entry, class_ref(clazz));
+        push_u2(entry, name_and_type(name, desc));
+
+        return add_constant("F" + clazz + "." + name + " " + desc, std::move(entry));
+}
+
+uint16_t
+HolderClass::method_ref(const std::string &clazz, const std::string &name, const std::string &desc)
+{
+        std::vector<uint8_t> entry = { HOLDER_CONSTANT_Methodref };
+
+        push_u2(entry, class_ref(clazz));
+        push_u2(entry, name_and_type(name, desc));
+
+        return add_constant("M" + clazz + "." + name + desc, std::move(entry));
+}
+
+void
+HolderClass::add_field(uint16_t access_flags, const std::string &name, const std::string &desc)
+{
+        fields.push_back(member_t { access_flags, utf8(name), utf8(desc), {} });
+}
+
+void
+HolderClass::add_method(uint16_t access_flags, const std::string &name, const std::string &desc, const HolderCode &code)
+{
+        std::vector<uint8_t> attribute;
+        auto &code_bytes = code.bytes();
+
+        push_u2(attribute, utf8("Code"));
+        push_u4(attribute, static_cast<uint32_t>(12 + code_bytes.size()));
+        push_u2(attribute, code.max_stack);
+        push_u2(attribute, code.max_locals);
+        push_u4(attribute, static_cast<uint32_t>(code_bytes.size()));
+        attribute.insert(attribute.end(), code_bytes.begin(), code_bytes.end());
+        push_u2(attribute, 0); // exception_table_length
+        push_u2(attribute, 0); // attributes_count
+
+        methods.push_back(member_t { access_flags, utf8(name), utf8(desc), std::move(attribute) });
+}
+
+std::vector<uint8_t>
+HolderClass::bytes() const
+{
+        std::vector<uint8_t> bytes;
+
+        push_u4(bytes, 0xCAFEBABE);
+        push_u2(bytes, 0); // minor
+        push_u2(bytes, HOLDER_MAJOR_VERSION);
+
+        push_u2(bytes, static_cast<uint16_t>(constant_pool.size()));
+        for (auto &entry : constant_pool)
+                bytes.insert(bytes.end(), entry.begin(), entry.end());
+
+        push_u2(bytes, HOLDER_ACC_SUPER | HOLDER_ACC_FINAL | HOLDER_ACC_SYNTHETIC);
+        push_u2(bytes, this_class);
+        push_u2(bytes, super_class);
+        push_u2(bytes, 0); // interfaces_count
+
+        for (auto *members : { &fields, &methods }) {
+                push_u2(bytes, static_cast<uint16_t>(members->size()));
+                for (auto &member : *members) {
+                        push_u2(bytes, member.access_flags);
+                        push_u2(bytes, member.name_index);
+                        push_u2(bytes, member.descriptor_index);
+                        push_u2(bytes, member.code_attribute.size() > 0 ? 1 : 0);
+                        bytes.insert(bytes.end(), member.code_attribute.begin(), member.code_attribute.end());
+                }
+        }
+
+        push_u2(bytes, 0); // attributes_count
+
+        return bytes;
+}
+
+std::string
+GetDispatchDesc(const std::string &target_name, const std::string &method_desc, bool is_static)
+{
+        if (is_static)
+                return method_desc;
+
+        return "(L" + target_name + ";" + method_desc.substr(1);
+}
+
+// Ends the 'dispatch' method of a holder, which returns the result of the native hook
+// method, or the result of the clone of the original method if any of `skips` is taken
+static void
+add_dispatch(HolderClass &holder, HolderCode &code, const std::vector<size_t> &skips, const std::string &target_name,
+             const std::string &method_desc, const method_desc_t &desc, bool is_static,
+             const std::string &native_name, const std::string &clone_name)
+{
+        uint16_t param_slots = GetParamSlots(desc, is_static);
+        uint8_t invoke = is_static ? OP_INVOKESTATIC : OP_INVOKEVIRTUAL;
+
+        for (auto *name : { &native_name, &clone_name }) {
+                if (name == &clone_name) {
+                        for (auto skip : skips)
+                                code.bind(skip);
+                }
+
+                if (!is_static)
+                        code.op_u1(OP_ALOAD, 0);
+                code.load_args(desc, is_static ? 0 : 1);
+                code.op_u2(invoke, holder.method_ref(target_name, *name, method_desc));
+                code.op(GetReturnOpcode(desc.ret));
+        }
+
+        code.max_stack = std::max<uint16_t>({ code.max_stack, param_slots, GetTypeSlots(desc.ret) });
+        code.max_locals = std::max(code.max_locals, param_slots);
+        holder.add_method(HOLDER_ACC_STATIC | HOLDER_ACC_SYNTHETIC, "dispatch",
+                          GetDispatchDesc(target_name, method_desc, is_static), code);
+}
+
+bool
+BuildGuardHolder(const std::string &holder_name, const std::string &target_name,
+                 const std::string &method_desc, bool is_static,
+                 const std::string &native_name, const std::string &clone_name,
+                 std::vector<uint8_t> &class_bytes)
+{
+        method_desc_t desc;
+        HolderClass holder(holder_name);
+        HolderCode code;
+
+        if (!ParseMethodDesc(method_desc, desc))
+                return false;
+
+        holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_VOLATILE | HOLDER_ACC_SYNTHETIC, "enabled", "Z");
+
+        // if (enabled) return native_name(args); else return clone_name(args);
+        code.op_u2(OP_GETSTATIC, holder.field_ref(holder_name, "enabled", "Z"));
+        auto disabled = code.branch(OP_IFEQ);
+        code.max_stack = 1;
+        add_dispatch(holder, code, { disabled }, target_name, method_desc, desc, is_static, native_name, clone_name);
+
+        class_bytes = holder.bytes();
+
+        return true;
+}
+
+bool
+BuildSampledHolder(const std::string &holder_name, const std::string &target_name,
+                   const std::string &method_desc, bool is_static,
+                   const std::string &native_name, const std::string &clone_name,
+                   std::vector<uint8_t> &class_bytes)
+{
+        method_desc_t desc;
+        HolderClass holder(holder_name);
+        HolderCode code;
+
+        if (!ParseMethodDesc(method_desc, desc))
+                return false;
+
+        holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_VOLATILE | HOLDER_ACC_SYNTHETIC, "period", "I");
+        holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_SYNTHETIC, "countdown", "I");
+
+        auto countdown = holder.field_ref(holder_name, "countdown", "I");
+
+        // if (--countdown > 0) return clone_name(args);
+        // countdown = period;
+        // return native_name(args);
+        code.op_u2(OP_GETSTATIC, countdown);
+        code.op(OP_ICONST_1);
+        code.op(OP_ISUB);
+        code.op(OP_DUP);
+        code.op_u2(OP_PUTSTATIC, countdown);
+        auto skipped = code.branch(OP_IFGT);
+        code.op_u2(OP_GETSTATIC, holder.field_ref(holder_name, "period", "I"));
+        code.op_u2(OP_PUTSTATIC, countdown);
+        code.max_stack = 2;
+        add_dispatch(holder, code, { skipped }, target_name, method_desc, desc, is_static, native_name, clone_name);
+
+        class_bytes = holder.bytes();
+
+        return true;
+}
+
+// Checks if a type is loaded as an int (i.e. it is compared with 'if_icmp*')
+static bool
+is_int_type(const std::string &type)
+{
+        return type.size() == 1 && std::string("ZBCSI").find(type[0]) != std::string::npos;
+}
+
+bool
+CanFilterParam(const method_desc_t &method_desc, const filter_cond_t &cond)
+{
+        if (cond.param >= method_desc.params.size())
+                return false;
+
+        auto &type = method_desc.params[cond.param];
+        bool is_object = type[0] == 'L' || type[0] == '[';
+
+        switch (cond.op) {
+        case FILTER_NULL:
+        case FILTER_NOT_NULL:
+                return is_object;
+        case FILTER_EQ:
+        case FILTER_NE:
+                return !is_object || type == HOLDER_STRING_DESC;
+        case FILTER_LT:
+        case FILTER_LE:
+        case FILTER_GT:
+        case FILTER_GE:
+                return !is_object;
+        }
+
+        return false;
+}
+
+bool
+GetFilterValueField(const method_desc_t &method_desc, size_t index, const filter_cond_t &cond,
+                    std::string &name, std::string &desc)
+{
+        if (cond.op == FILTER_NULL || cond.op == FILTER_NOT_NULL)
+                return false;
+
+        auto &type = method_desc.params[cond.param];
+
+        name = "value" + std::to_string(index);
+        desc = is_int_type(type) ? "I" : type;
+
+        return true;
+}
+
+bool
+BuildFilterHolder(const std::string &holder_name, const std::string &target_name,
+                  const std::string &method_desc, bool is_static,
+                  const std::string &native_name, const std::string &clone_name,
+                  const std::vector<filter_cond_t> &conds, std::vector<uint8_t> &class_bytes)
+{
+        // Branches taken when a condition does not hold, by comparison
+        static const uint8_t icmp_skips[] = { OP_IF_ICMPNE, OP_IF_ICMPEQ, OP_IF_ICMPGE, OP_IF_ICMPGT, OP_IF_ICMPLE, OP_IF_ICMPLT };
+        static const uint8_t cmp_skips[] = { OP_IFNE, OP_IFEQ, OP_IFGE, OP_IFGT, OP_IFLE, OP_IFLT };
+        method_desc_t desc;
+        HolderClass holder(holder_name);
+        HolderCode code;
+        std::vector<size_t> skips;
+
+        if (!ParseMethodDesc(method_desc, desc))
+                return false;
+
+        // Local variable slot of each parameter
+        std::vector<uint16_t> slots;
+        uint16_t slot = is_static ? 0 : 1;
+        for (auto &param : desc.params) {
+                slots.push_back(slot);
+                slot += GetTypeSlots(param);
+        }
+
+        // if (!cond0 || !cond1 || ...) return clone_name(args);
+        // return native_name(args);
+        for (size_t i = 0; i < conds.size(); ++i) {
+                auto &cond = conds[i];
+                std::string field_name, field_desc;
+
+                if (!CanFilterParam(desc, cond))
+                        return false;
+
+                auto &type = desc.params[cond.param];
+                auto load = GetLoadOpcode(type);
+                auto param_slot = static_cast<uint8_t>(slots[cond.param]);
+
+                if (!GetFilterValueField(desc, i, cond, field_name, field_desc)) {
+                        // Null checks don't have a value
+                        code.op_u1(load, param_slot);
+                        skips.push_back(code.branch(cond.op == FILTER_NULL ? OP_IFNONNULL : OP_IFNULL));
+                        continue;
+                }
+
+                holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_VOLATILE | HOLDER_ACC_SYNTHETIC, field_name, field_desc);
+                auto value = holder.field_ref(holder_name, field_name, field_desc);
+
+                if (type == HOLDER_STRING_DESC) {
+                        // The value is never null, so it is the receiver of 'equals'
+                        code.op_u2(OP_GETSTATIC, value);
+                        code.op_u1(load, param_slot);
+                        code.op_u2(OP_INVOKEVIRTUAL, holder.method_ref("java/lang/String", "equals", "(Ljava/lang/Object;)Z"));
+                        skips.push_back(code.branch(cond.op == FILTER_EQ ? OP_IFEQ : OP_IFNE));
+                        continue;
+                }
+
+                code.op_u1(load, param_slot);
+                code.op_u2(OP_GETSTATIC, value);
+                if (is_int_type(type)) {
+                        skips.push_back(code.branch(icmp_skips[cond.op]));
+                        continue;
+                }
+
+                // NOTE: NaN must fail every comparison but 'NE', so it compares
+                //       as greater for 'LT' and 'LE', and as lesser otherwise
+                bool nan_greater = cond.op == FILTER_LT || cond.op == FILTER_LE;
+                switch (type[0]) {
+                case 'J':
+                        code.op(OP_LCMP);
+                        break;
+                case 'F':
+                        code.op(nan_greater ? OP_FCMPG : OP_FCMPL);
+                        break;
+                case 'D':
+                        code.op(nan_greater ? OP_DCMPG : OP_DCMPL);
+                        break;
+                }
+                skips.push_back(code.branch(cmp_skips[cond.op]));
+        }
+
+        code.max_stack = 4; // Two longs or doubles being compared
+        add_dispatch(holder, code, skips, target_name, method_desc, desc, is_static, native_name, clone_name);
+
+        class_bytes = holder.bytes();
+
+        return true;
+}
+
+bool
+BuildCounterHolder(const std::string &holder_name, bool striped, std::vector<uint8_t> &class_bytes)
+{
+        HolderClass holder(holder_name);
+        HolderCode code;
+
+        if (!striped) {
+                holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_SYNTHETIC, "count", "J");
+                class_bytes = holder.bytes();
+
+                return true;
+        }
+
+        holder.add_field(HOLDER_ACC_STATIC | HOLDER_ACC_FINAL | HOLDER_ACC_SYNTHETIC, "adder", HOLDER_LONG_ADDER_DESC);
+
+        // adder = new LongAdder();
+        code.op_u2(OP_NEW, holder.class_ref(HOLDER_LONG_ADDER_CLASS));
+        code.op(OP_DUP);
+        code.op_u2(OP_INVOKESPECIAL, holder.method_ref(HOLDER_LONG_ADDER_CLASS, "<init>", "()V"));
+        code.op_u2(OP_PUTSTATIC, holder.field_ref(holder_name, "adder", HOLDER_LONG_ADDER_DESC));
+        code.op(OP_RETURN);
+
+        code.max_stack = 2;
+        code.max_locals = 0;
+        holder.add_method(HOLDER_ACC_STATIC | HOLDER_ACC_SYNTHETIC, "<clinit>", "()V", code);
+
+        class_bytes = holder.bytes();
+
+        return true;
+}
@@ -0,0 +1,251 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOLDER_HPP_
+#define _HOLDER_HPP_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Holder classes are small synthetic classes that JNIHook defines next to a
+ * hooked class. They keep the state of the hooks (e.g. guard fields), which
+ * can't be added to a class through a redefinition, and the code that needs
+ * branches, so that the code injected into the hooked class stays branch-free.
+ *
+ * They are written with class file version 49, so that no StackMapTable
+ * is needed for the branches.
+ */
+
+/* opcodes used by the holder classes */
+enum {
+        OP_ICONST_0      = 0x03,
+        OP_ICONST_1      = 0x04,
+        OP_LCONST_1      = 0x0a,
+        OP_ILOAD         = 0x15,
+        OP_LLOAD         = 0x16,
+        OP_FLOAD         = 0x17,
+        OP_DLOAD         = 0x18,
+        OP_ALOAD         = 0x19,
+        OP_DUP           = 0x59,
+        OP_LADD          = 0x61,
+        OP_ISUB          = 0x64,
+        OP_LCMP          = 0x94,
+        OP_FCMPL         = 0x95,
+        OP_FCMPG         = 0x96,
+        OP_DCMPL         = 0x97,
+        OP_DCMPG         = 0x98,
+        OP_IFEQ          = 0x99,
+        OP_IFNE          = 0x9a,
+        OP_IFLT          = 0x9b,
+        OP_IFGE          = 0x9c,
+        OP_IFGT          = 0x9d,
+        OP_IFLE          = 0x9e,
+        OP_IF_ICMPEQ     = 0x9f,
+        OP_IF_ICMPNE     = 0xa0,
+        OP_IF_ICMPLT     = 0xa1,
+        OP_IF_ICMPGE     = 0xa2,
+        OP_IF_ICMPGT     = 0xa3,
+        OP_IF_ICMPLE     = 0xa4,
+        OP_IRETURN       = 0xac,
+        OP_LRETURN       = 0xad,
+        OP_FRETURN       = 0xae,
+        OP_DRETURN       = 0xaf,
+        OP_ARETURN       = 0xb0,
+        OP_RETURN        = 0xb1,
+        OP_GETSTATIC     = 0xb2,
+        OP_PUTSTATIC     = 0xb3,
+        OP_INVOKEVIRTUAL = 0xb6,
+        OP_INVOKESPECIAL = 0xb7,
+        OP_INVOKESTATIC  = 0xb8,
+        OP_NEW           = 0xbb,
+        OP_IFNULL        = 0xc6,
+        OP_IFNONNULL     = 0xc7,
+};
+
+/* counter of a striped counter holder */
+#define HOLDER_LONG_ADDER_CLASS "java/util/concurrent/atomic/LongAdder"
+#define HOLDER_LONG_ADDER_DESC  "L" HOLDER_LONG_ADDER_CLASS ";"
+
+/* comparisons of the conditions of a filter holder (same order as `jnihook_filter_op_t`) */
+enum {
+        FILTER_EQ = 0,
+        FILTER_NE,
+        FILTER_LT,
+        FILTER_LE,
+        FILTER_GT,
+        FILTER_GE,
+        FILTER_NULL,
+        FILTER_NOT_NULL,
+};
+
+/* string arguments are compared with `String.equals` */
+#define HOLDER_STRING_DESC "Ljava/lang/String;"
+
+// Condition of a filter holder on a parameter of the target method
+typedef struct filter_cond_t {
+        size_t param; // Index in the parameters of the method descriptor
+        int op;       // FILTER_*
+} filter_cond_t;
+
+// Parameter and return types of a method descriptor
+typedef struct method_desc_t {
+        std::vector<std::string> params;
+        std::string ret;
+} method_desc_t;
+
+bool
+ParseMethodDesc(const std::string &desc, method_desc_t &method_desc);
+
+// Number of local variable (or operand stack) slots taken by a type
+uint16_t
+GetTypeSlots(const std::string &type);
+
+// Number of local variable slots taken by the parameters of a method
+uint16_t
+GetParamSlots(const method_desc_t &method_desc, bool is_static);
+
+uint8_t
+GetLoadOpcode(const std::string &type);
+
+uint8_t
+GetReturnOpcode(const std::string &type);
+
+class HolderCode {
+private:
+        std::vector<uint8_t> code;
+public:
+        uint16_t max_stack = 0;
+        uint16_t max_locals = 0;
+
+        void op(uint8_t opcode);
+        void op_u1(uint8_t opcode, uint8_t operand);
+        void op_u2(uint8_t opcode, uint16_t operand);
+
+        // Emits a branch and returns its position, which must be bound later
+        size_t branch(uint8_t opcode);
+        // Makes a branch jump to the current position
+        void bind(size_t branch);
+
+        // Loads local variables as the arguments of a method, starting at `slot`
+        // and returns the number of slots loaded
+        uint16_t load_args(const method_desc_t &method_desc, uint16_t slot);
+
+        inline const std::vector<uint8_t> &bytes() const { return code; }
+};
+
+class HolderClass {
+private:
+        typedef struct {
+                uint16_t access_flags;
+                uint16_t name_index;
+                uint16_t descriptor_index;
+                std::vector<uint8_t> code_attribute; // Empty for fields
+        } member_t;
+
+        std::vector<std::vector<uint8_t>> constant_pool;
+        std::map<std::string, uint16_t> constants; // Deduplicates the constant pool entries
+        uint16_t this_class;
+        uint16_t super_class;
+        std::vector<member_t> fields;
+        std::vector<member_t> methods;
+
+        uint16_t add_constant(const std::string &key, std::vector<uint8_t> entry);
+public:
+        HolderClass(const std::string &name, const std::string &super_name = "java/lang/Object");
+
+        uint16_t utf8(const std::string &str);
+        uint16_t class_ref(const std::string &name);
+        uint16_t name_and_type(const std::string &name, const std::string &desc);
+        uint16_t field_ref(const std::string &clazz, const std::string &name, const std::string &desc);
+        uint16_t method_ref(const std::string &clazz, const std::string &name, const std::string &desc);
+
+        void add_field(uint16_t access_flags, const std::string &name, const std::string &desc);
+        void add_method(uint16_t access_flags, const std::string &name, const std::string &desc, const HolderCode &code);
+
+        std::vector<uint8_t> bytes() const;
+};
+
+/*
+ * Builds the holder of a guarded hook, which has a 'static volatile boolean enabled'
+ * guard field and a 'dispatch' method that calls either the native hook method or
+ * the clone of the original method of the target class, depending on the guard.
+ * For instance methods, 'dispatch' takes the object as its first parameter.
+ */
+bool
+BuildGuardHolder(const std::string &holder_name, const std::string &target_name,
+                 const std::string &method_desc, bool is_static,
+                 const std::string &native_name, const std::string &clone_name,
+                 std::vector<uint8_t> &class_bytes);
+
+/*
+ * Builds the holder of a sampled hook, which has a 'static volatile int period' field
+ * and a 'dispatch' method like the one of a guarded hook, that only calls the native hook
+ * method once every 'period' calls, counted down by a 'static int countdown' field.
+ * Calls from many threads may race on the countdown, which only skews the sampling.
+ */
+bool
+BuildSampledHolder(const std::string &holder_name, const std::string &target_name,
+                   const std::string &method_desc, bool is_static,
+                   const std::string &native_name, const std::string &clone_name,
+                   std::vector<uint8_t> &class_bytes);
+
+/*
+ * Builds the holder of a filtered hook, which has a 'dispatch' method like the one of a
+ * guarded hook, that only calls the native hook method if every condition holds.
+ * The value a condition compares its parameter to is a static field of the holder,
+ * named after the index of the condition (see `GetFilterValueField`), so that the
+ * same holder serves any value.
+ */
+bool
+BuildFilterHolder(const std::string &holder_name, const std::string &target_name,
+                  const std::string &method_desc, bool is_static,
+                  const std::string &native_name, const std::string &clone_name,
+                  const std::vector<filter_cond_t> &conds, std::vector<uint8_t> &class_bytes);
+
+// Checks if a condition can be evaluated on its parameter: primitives can be compared
+// to a value, strings can be compared to a string for equality, and every object can
+// be checked for null
+bool
+CanFilterParam(const method_desc_t &method_desc, const filter_cond_t &cond);
+
+// Name and descriptor of the value field of a filter condition, returns false if the
+// condition has no value (i.e. null checks)
+bool
+GetFilterValueField(const method_desc_t &method_desc, size_t index, const filter_cond_t &cond,
+                    std::string &name, std::string &desc);
+
+/*
+ * Builds the holder of a counter hook, which only has the counter incremented by the
+ * hooked method: a 'static long count' field, or a 'static final LongAdder adder' field
+ * that is created by the class initializer if the counter is striped.
+ */
+bool
+BuildCounterHolder(const std::string &holder_name, bool striped, std::vector<uint8_t> &class_bytes);
+
+// Descriptor of the 'dispatch' method of a holder for a target method
+std::string
+GetDispatchDesc(const std::string &target_name, const std::string &method_desc, bool is_static);
+
+#endif
@@ -22,16 +22,32 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <jnihook.h>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
+#include <cctype>
 #include <cstring>
 #include <jnif.hpp>
+#include "bloom.hpp"
+#include "diskcache.hpp"
+#include "holder.hpp"
 #include "jvm.hpp"
+#include "lru.hpp"
+#include "parallel.hpp"
+#include "rcu.hpp"
+#include "sharded.hpp"
 #include "uuid.hpp"
 #ifdef JNIHOOK_DEBUG
         #define LOG(...) {printf("[JNIHOOK] " __VA_ARGS__);fflush(stdout);}
@@ -59,20 +75,285 @@ typedef struct hook_info_t {
         method_info_t method_info;
         void *native_hook_method;
         std::optional<size_t> bytecode_offset;
+        std::string holder_name; // Holder class used by the patched method (if any)
+        std::optional<void *> exit_probe; // Probe hooks only, `native_hook_method` is the entry probe
+        std::optional<bool> striped_counter; // Counter hooks only, whether the counter is a `LongAdder`
+        bool sampled = false; // Sampled hooks are patched like guarded hooks, with another holder
+        bool filtered = false; // Filtered hooks too
 } hook_info_t;
 
+// Identity of a class, which is the class loader that defined it and its name
+// NOTE: Classes with the same name that are defined by different class loaders
+//       are different classes, with their own bytes and hooks
+typedef struct class_id_t {
+        jlong loader; // See `get_loader_id`
+        std::string name;
+
+        bool operator==(const class_id_t &other) const
+        {
+                return loader == other.loader && name == other.name;
+        }
+} class_id_t;
+
+struct class_id_hash {
+        size_t operator()(const class_id_t &id) const
+        {
+                return std::hash<std::string> {}(id.name) ^ (static_cast<size_t>(id.loader) * 0x9e3779b97f4a7c15ULL);
+        }
+};
+
 enum class HookType {
     Native,           // Native method hooking (default)
     Init,             // Constructor (bytecode hooking + specific things)
     ClInit,           // Static class initializer (bytecode hooking + specific things)
     Bytecode, // Bytecode hooking
+    Guarded,          // Native method hooking that can be toggled through a guard field
+    Probe,            // Calls to native probes around the original code, which stays in place
+    Counter,          // Invocation counter in injected bytecode, without native code
+    Sampled,          // Guarded hook that only calls the native method once every N calls
+    Filtered,         // Guarded hook that only calls the native method when the arguments match
+};
+
+// Filter of a filtered hook, which owns its string value
+typedef struct filter_t {
+        filter_cond_t cond;
+        jvalue value;
+        std::optional<std::string> string;
+} filter_t;
+
+static_assert(FILTER_EQ == static_cast<int>(JNIHOOK_FILTER_EQ) && FILTER_NOT_NULL == static_cast<int>(JNIHOOK_FILTER_NOT_NULL),
+              "filter comparisons must match jnihook_filter_op_t");
+
+typedef struct attach_request_t {
+        jmethodID method;
+        void *native_hook_method;
+        jmethodID *original_method;
+        std::optional<size_t> bytecode_offset;
+        std::optional<jboolean> guard; // Initial state of the guard of a guarded hook
+        std::optional<void *> exit_probe; // Probe hooks only, `native_hook_method` is the entry probe
+        std::optional<bool> striped_counter; // Counter hooks only, whether the counter is a `LongAdder`
+        std::optional<jint> sample_period; // Sampled hooks only, initial sampling period
+        std::optional<std::vector<filter_t>> filters; // Filtered hooks only
+} attach_request_t;
+
+// Resolved information about an attach request
+typedef struct prepared_hook_t {
+        const attach_request_t *request;
+        jclass clazz;
+        class_id_t clazz_id;
+        method_info_t method_info;
+        HookType hook_type;
+        std::string native_name; // Name of the method that will be registered as native
+        std::string native_signature;
+        std::string exit_name; // Name of the exit probe of a probe hook
+        std::string holder_name;
+        struct holder_t *holder = nullptr; // Holder whose state is set by the request (guarded, sampled and filtered hooks)
+        bool live_holder = false; // Whether the installed hook of the method uses `holder` already
+        method_desc_t filter_desc; // Filtered hooks only, the parsed descriptor of the method
+        std::vector<jvalue> filter_values; // Filtered hooks only, the strings are local references
+} prepared_hook_t;
+
+// Hook registered by class name, applied when the class gets loaded
+typedef struct deferred_hook_t {
+        std::string method_name;
+        std::string signature;
+        void *native_hook_method;
+        jmethodID *original_method;
+        jint access_flags; // Only known once the class is loaded
+} deferred_hook_t;
+
+typedef struct suspended_threads_t {
+        jthread *threads; // Buffer returned by `GetAllThreads`
+        jint thread_count;
+        std::vector<jthread> suspended;
+} suspended_threads_t;
+
+// Queued asynchronous attach or detach operation
+typedef struct async_job_t {
+        bool detach;
+        std::vector<attach_request_t> requests; // Attach only
+        std::vector<jmethodID> methods;         // Detach only
+        jnihook_async_t *handle;
+} async_job_t;
+
+struct jnihook_async_t {
+        std::mutex mutex;
+        std::condition_variable done_cond;
+        bool done = false;
+        jnihook_result_t result = JNIHOOK_ERR_UNKNOWN;
+        std::atomic<int> refs = 1; // Owned by the worker, plus the caller if it asked for the handle
+        jnihook_async_callback_t callback = nullptr;
+        void *user_data = nullptr;
 };
 
 static std::unique_ptr<jnihook_t> g_jnihook = nullptr;
-static std::unordered_map<std::string, std::vector<hook_info_t>> g_hooks;
-static std::unordered_map<std::string, std::unique_ptr<ClassFile>> g_class_file_cache;
+// Hooks of a class, keyed by method name and descriptor (see `get_method_key`)
+typedef std::unordered_map<std::string, hook_info_t> class_hooks_t;
+
+// Entry of the parsed class cache, which is either the original form of a class
+// or its last patched version (see `g_parsed_class_cache`)
+typedef struct parsed_class_t {
+        std::shared_ptr<ClassFile> cf;
+        class_hooks_t applied; // Hooks that are applied to `cf` (patched versions only)
+} parsed_class_t;
+
+// Class that missed the patched class caches, and has to be patched (see `PatchClasses`)
+typedef struct patch_job_t {
+        class_id_t clazz_id;
+        class_hooks_t hooks;
+        std::string patched_key;
+        parsed_class_t patched; // Last patched version, taken out of `g_parsed_class_cache`
+        std::vector<u1> *class_bytes; // Output
+        bool incremental;
+        std::shared_ptr<ClassFile> cf; // Parsed original class, for a full patch
+        std::shared_ptr<std::vector<u1>> original; // Original bytes, if the class isn't parsed yet
+        bool parsed = false; // Whether the job parsed `cf` itself
+        jnihook_result_t result = JNIHOOK_ERR_UNKNOWN;
+} patch_job_t;
+
+// Synthetic class that holds the state of a hook (see `holder.hpp`)
+typedef struct holder_t {
+        std::string name;
+        jclass clazz; // Global reference
+        jfieldID enabled_field = nullptr; // Guarded hooks only
+        jfieldID counter_field = nullptr; // Counter hooks only, a `long` or a `LongAdder` if striped
+        jmethodID sum_method = nullptr;   // Striped counter hooks only (`LongAdder.sum`)
+        jfieldID period_field = nullptr;  // Sampled hooks only
+        jfieldID countdown_field = nullptr; // Sampled hooks only
+        std::vector<jfieldID> value_fields; // Filtered hooks only, by filter (nullptr for null checks)
+} holder_t;
+
+// Location of a hook in `g_hooks`
+typedef struct hook_location_t {
+        class_id_t clazz_id;
+        std::string method_key;
+} hook_location_t;
+
+// NOTE: The hooks and the class bytes are sharded, so that the class loading threads
+//       (see `JNIHook_ClassFileLoadHook`) only contend when they load the same classes
+static ShardedMap<class_id_t, class_hooks_t, class_id_hash> g_hooks;
+static std::unordered_map<jmethodID, hook_location_t> g_method_hooks; // Secondary index of `g_hooks`
+static ShardedMap<class_id_t, std::shared_ptr<std::vector<u1>>, class_id_hash> g_class_file_cache; // Original class bytes
+static std::unordered_map<std::string, holder_t> g_holders; // Keyed by `get_holder_key`, reused across attaches
+static std::unordered_map<std::string, size_t> g_holder_generations; // Names given to holder classes, kept by `JNIHook_Shutdown`
 // static std::unordered_map<std::string, jclass> g_original_classes;
-static std::atomic<bool> g_force_class_caching = false;
+static std::unordered_map<std::string, std::vector<deferred_hook_t>> g_deferred_hooks; // Applied to every class loaded with the name
+static std::unordered_map<class_id_t, std::vector<deferred_hook_t>, class_id_hash> g_loaded_deferred_hooks; // Waiting for the class to be prepared
+static std::mutex g_class_caching_mutex;
+static std::unordered_set<std::string> g_classes_being_cached; // Retransformed by `CacheClasses`
+static std::vector<std::string> g_passive_caching_prefixes;    // See `JNIHook_SetPassiveCaching`
+static std::atomic<jnihook_suspend_policy_t> g_suspend_policy = JNIHOOK_SUSPEND_ALL;
+static jnihook_latency_t g_attach_latency[JNIHOOK_SUSPEND_POLICY_COUNT] = {};
+
+// Immutable view of the hooks, which is read without any lock by the class
+// loading threads and by the hooks themselves (see `publish_snapshot`)
+typedef struct hooks_snapshot_t {
+        std::unordered_map<std::string, std::vector<deferred_hook_t>> deferred_hooks; // Keyed by class name
+        std::vector<std::string> passive_caching_prefixes;
+        std::unordered_map<jmethodID, holder_t> holders; // Holders of the methods with a hook that has one
+} hooks_snapshot_t;
+
+// Concurrency model:
+// - The operations that modify the hooks are serialized by `g_hooks_mutex` (the writer
+//   lock), which can be taken by the caller threads, the hooks themselves and the
+//   asynchronous worker.
+// - What the class loading threads need is published by the writers as an immutable
+//   snapshot in `g_snapshot`. JNIHook_ClassFileLoadHook and JNIHook_ClassPrepare hold
+//   a read guard while they run, so the snapshot (and `g_jnihook`) outlive them.
+// - The rest of the state shared with the class loading threads is either sharded
+//   (`g_hooks`, `g_class_file_cache`) or behind leaf locks. A leaf lock is never held
+//   while waiting for the readers of a snapshot, or while calling into the JVM in a
+//   way that can run Java code or class loading events (e.g. `RedefineClasses`). The
+//   only JVM calls made under one are JNI reference operations, like the `IsSameObject`
+//   and weak global reference calls of `get_loader_id` and `get_class_id`.
+static std::recursive_mutex g_hooks_mutex;
+static RcuPtr<hooks_snapshot_t> g_snapshot;
+static std::mutex g_method_hooks_mutex;         // Protects `g_method_hooks`
+static std::mutex g_loaded_deferred_hooks_mutex; // Protects `g_loaded_deferred_hooks`
+static std::mutex g_patch_mutex;                // Protects the patching caches and their counters
+
+// Asynchronous worker state (see `JNIHook_AttachAsync`)
+static std::mutex g_async_mutex;
+static std::condition_variable g_async_cond;
+static std::deque<async_job_t> g_async_queue;
+static std::thread g_async_worker;
+static bool g_async_stop = false;
+static std::atomic<jlong> g_async_coalesce_window_us = 2000;
+
+// Maximum stack depth inspected for targeted thread suspension
+static constexpr jint TARGETED_SUSPEND_MAX_FRAMES = 256;
+
+// Serialized patched classes, keyed by `get_patched_class_key`
+static constexpr size_t DEFAULT_PATCH_CACHE_BUDGET = 16 * 1024 * 1024;
+static LruCache<std::string, std::vector<u1>> g_patch_cache(DEFAULT_PATCH_CACHE_BUDGET);
+static jlong g_patch_cache_hits = 0;
+static jlong g_patch_cache_misses = 0;
+static std::atomic<size_t> g_patch_threads = 0; // See `JNIHook_SetPatchThreads`
+
+// Patched classes kept across restarts (see `JNIHook_SetDiskCacheDirectory`)
+static DiskCache g_disk_cache;
+static jlong g_disk_cache_hits = 0;
+static jlong g_disk_cache_misses = 0;
+
+// Unique suffix of the names generated by JNIHook (see `get_names_uuid`)
+static std::mutex g_names_uuid_mutex;
+static std::string g_names_uuid;
+static bool g_names_uuid_used = false;
+
+// Parsed forms of the classes in `g_class_file_cache`, parsed on demand and keyed by
+// `get_class_key`, and their last patched versions, kept for incremental patching and
+// keyed by `get_patched_class_file_key`
+// NOTE: The weight of a parsed class is approximated by the size of its original bytes,
+//       and the one of a patched version by the size of its patched bytes
+static LruCache<std::string, parsed_class_t> g_parsed_class_cache(SIZE_MAX);
+
+// Memoised identity of a class (see `get_class_id`)
+typedef struct class_id_entry_t {
+        jweak clazz;
+        class_id_t id;
+} class_id_entry_t;
+
+// Identifier given to a class loader (see `get_loader_id`)
+typedef struct loader_entry_t {
+        jweak loader;
+        jlong id;
+} loader_entry_t;
+
+// Cumulative counters reported by `JNIHook_GetStats`
+static jlong g_redefinitions = 0;
+static jlong g_redefined_classes = 0;
+static jlong g_cache_class_ns = 0;
+static jlong g_reapply_classes_ns = 0;
+static jlong g_redefine_classes_ns = 0;
+
+// Prefilter of the classes that have (or had) hooks or deferred hooks, which lets
+// JNIHook_ClassFileLoadHook reject the other classes without any lookup
+// NOTE: `g_hooks` and `g_deferred_hooks` are the exact sets behind the filter
+static BloomFilter<1 << 16, 4> g_hooked_classes_filter;
+
+static std::mutex g_class_ids_mutex;
+static std::unordered_map<jint, std::vector<class_id_entry_t>> g_class_ids; // Keyed by identity hash code
+
+static std::mutex g_loaders_mutex;
+static std::unordered_map<jint, std::vector<loader_entry_t>> g_loaders; // Keyed by identity hash code
+static jlong g_next_loader_id = 1;
+
+static inline jlong
+get_elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return static_cast<jlong>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+// Adds the time spent in a scope to a counter
+class ScopedTimer {
+private:
+        jlong &total_ns;
+        std::chrono::steady_clock::time_point start;
+public:
+        ScopedTimer(jlong &total_ns) : total_ns(total_ns), start(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer() { total_ns += get_elapsed_ns(start); }
+};
 
 static std::string
 get_class_signature(jvmtiEnv *jvmti, jclass clazz)
@@ -90,36 +371,261 @@ get_class_signature(jvmtiEnv *jvmti, jclass clazz)
         return signature;
 }
 
-static std::string
-get_class_name(JNIEnv *env, jclass clazz)
+// Gives a stable identifier to a class loader, which is 0 for the bootstrap class loader
+// NOTE: The class loaders are tracked through weak global references, bucketed by
+//       their identity hash code. Identifiers are never reused, so the identifier of
+//       a class loader that was collected can't be mistaken for another one.
+static jlong
+get_loader_id(JNIEnv *env, jobject loader)
 {
-        jclass klass = env->FindClass("java/lang/Class");
-        if (!klass)
-                return "";
+        jint hash;
 
-        jmethodID getName_method = env->GetMethodID(klass, "getName", "()Ljava/lang/String;");
-        if (!getName_method)
-                return "";
+        if (!loader)
+                return 0;
 
-        jstring name_obj = reinterpret_cast<jstring>(env->CallObjectMethod(clazz, getName_method));
-        if (!name_obj)
-                return "";
+        if (g_jnihook->jvmti->GetObjectHashCode(loader, &hash) != JVMTI_ERROR_NONE)
+                return -1;
 
-        const char *c_name = env->GetStringUTFChars(name_obj, 0);
-        if (!c_name)
-                return "";
+        std::lock_guard lock(g_loaders_mutex);
+        auto &bucket = g_loaders[hash];
+
+        for (size_t i = 0; i < bucket.size();) {
+                auto &entry = bucket[i];
 
-        std::string name = std::string(c_name, &c_name[strlen(c_name)]);
+                if (env->IsSameObject(entry.loader, loader))
+                        return entry.id;
 
-        env->ReleaseStringUTFChars(name_obj, c_name);
+                if (env->IsSameObject(entry.loader, NULL)) {
+                        env->DeleteWeakGlobalRef(entry.loader);
+                        bucket.erase(bucket.begin() + i);
+                        continue;
+                }
 
-        // Replace dots with slashes to match contents of ClassFile
-        for (size_t i = 0; i < name.length(); ++i) {
-                if (name[i] == '.')
-                        name[i] = '/';
+                ++i;
         }
-        
-        return name;
+
+        jweak weak_loader = env->NewWeakGlobalRef(loader);
+        if (!weak_loader)
+                return -1;
+
+        bucket.push_back(loader_entry_t { weak_loader, g_next_loader_id });
+
+        return g_next_loader_id++;
+}
+
+// Key of a class identity in the maps that are keyed by strings
+static inline std::string
+get_class_key(const class_id_t &id)
+{
+        return id.name + "@" + std::to_string(id.loader);
+}
+
+// Key of the last patched version of a class in `g_parsed_class_cache`
+static inline std::string
+get_patched_class_file_key(const class_id_t &id)
+{
+        return get_class_key(id) + "#patched";
+}
+
+// Resolves the identity of a class (e.g. 'java/lang/String' in the bootstrap class loader)
+// without calling into Java. The name of the returned identity is empty on failure.
+// NOTE: The identities are memoised through weak global references, bucketed by the
+//       identity hash code of the classes. Entries of unloaded classes are
+//       dropped when their bucket is looked up.
+static class_id_t
+get_class_id(JNIEnv *env, jclass clazz)
+{
+        jint hash;
+        jobject loader;
+        auto jvmti = g_jnihook->jvmti;
+
+        if (jvmti->GetObjectHashCode(clazz, &hash) != JVMTI_ERROR_NONE)
+                return class_id_t { -1, "" };
+
+        {
+                std::lock_guard lock(g_class_ids_mutex);
+                auto &bucket = g_class_ids[hash];
+
+                for (size_t i = 0; i < bucket.size();) {
+                        auto &entry = bucket[i];
+
+                        if (env->IsSameObject(entry.clazz, clazz))
+                                return entry.id;
+
+                        if (env->IsSameObject(entry.clazz, NULL)) {
+                                env->DeleteWeakGlobalRef(entry.clazz);
+                                bucket.erase(bucket.begin() + i);
+                                continue;
+                        }
+
+                        ++i;
+                }
+        }
+
+        if (jvmti->GetClassLoader(clazz, &loader) != JVMTI_ERROR_NONE)
+                return class_id_t { -1, "" };
+
+        class_id_t id { get_loader_id(env, loader), "" };
+        if (loader)
+                env->DeleteLocalRef(loader);
+
+        if (id.loader < 0)
+                return id;
+
+        // Class signatures have the format 'Lpackage/ClassName;', which matches
+        // the contents of the ClassFile once the 'L' and ';' are removed.
+        // Array classes keep their signature (e.g. '[Ljava/lang/String;').
+        id.name = get_class_signature(jvmti, clazz);
+        if (id.name.length() > 2 && id.name[0] == 'L' && id.name[id.name.length() - 1] == ';')
+                id.name = id.name.substr(1, id.name.length() - 2);
+
+        if (id.name.length() == 0)
+                return id;
+
+        jweak weak_clazz = env->NewWeakGlobalRef(clazz);
+        if (!weak_clazz)
+                return id;
+
+        std::lock_guard lock(g_class_ids_mutex);
+        g_class_ids[hash].push_back(class_id_entry_t { weak_clazz, id });
+
+        return id;
+}
+
+// Drops the memoised class identities and the class loader identifiers
+static void
+clear_class_ids(JNIEnv *env)
+{
+        {
+                std::lock_guard lock(g_class_ids_mutex);
+
+                for (auto &[_hash, bucket] : g_class_ids) {
+                        for (auto &entry : bucket)
+                                env->DeleteWeakGlobalRef(entry.clazz);
+                }
+                g_class_ids.clear();
+        }
+
+        std::lock_guard lock(g_loaders_mutex);
+
+        for (auto &[_hash, bucket] : g_loaders) {
+                for (auto &entry : bucket)
+                        env->DeleteWeakGlobalRef(entry.loader);
+        }
+        g_loaders.clear();
+}
+
+static inline uint64_t
+fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+        auto bytes = static_cast<const u1 *>(data);
+
+        for (size_t i = 0; i < size; ++i) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+// Which probes a probe hook calls (0 for other hooks), since the missing probes
+// aren't called by the patched method
+static inline int
+get_probe_mask(const hook_info_t &hook)
+{
+        if (!hook.exit_probe)
+                return 0;
+
+        return 1 | (hook.native_hook_method ? 2 : 0) | (*hook.exit_probe ? 4 : 0);
+}
+
+// Checks if two hooks patch a method in the same way
+static inline bool
+same_patch(const hook_info_t &a, const hook_info_t &b)
+{
+        return a.bytecode_offset == b.bytecode_offset && a.holder_name == b.holder_name &&
+               get_probe_mask(a) == get_probe_mask(b) && a.striped_counter == b.striped_counter;
+}
+
+// Fingerprint of the set of hooks of a class, which identifies how the class is patched
+// NOTE: Only what is compared by `same_patch` is part of the fingerprint, because that
+//       is all that changes the patched class
+static std::string
+get_hooks_fingerprint(const class_hooks_t &hooks)
+{
+        std::vector<std::string> entries;
+        uint64_t hash = fnv1a(nullptr, 0);
+
+        for (auto &[key, hook] : hooks) {
+                std::string entry = key;
+
+                if (hook.bytecode_offset.has_value())
+                        entry += "@" + std::to_string(hook.bytecode_offset.value());
+                if (hook.holder_name.length() > 0)
+                        entry += "$" + hook.holder_name;
+                if (auto mask = get_probe_mask(hook); mask != 0)
+                        entry += "!" + std::to_string(mask);
+                if (hook.striped_counter)
+                        entry += *hook.striped_counter ? "+striped" : "+";
+                entries.push_back(entry);
+        }
+
+        // The iteration order of `class_hooks_t` is not stable
+        std::sort(entries.begin(), entries.end());
+        for (auto &entry : entries)
+                hash = fnv1a(entry.c_str(), entry.size() + 1, hash); // Includes the null terminator as a separator
+
+        std::stringstream ss;
+        ss << std::hex << hash << ":" << entries.size();
+        return ss.str();
+}
+
+// Unique suffix of the names generated by JNIHook, which avoids clashes with
+// the names of the methods and classes of the application
+// NOTE: The patched classes contain these names, so the disk cache keeps the
+//       suffix, to be reused by the next runs (see `JNIHook_SetDiskCacheDirectory`)
+static const std::string &
+get_names_uuid()
+{
+        std::lock_guard lock(g_names_uuid_mutex);
+
+        // NOTE: The suffix never changes once it is used, so the reference stays valid
+        if (g_names_uuid.length() == 0)
+                g_names_uuid = GenerateUuid();
+
+        g_names_uuid_used = true;
+        return g_names_uuid;
+}
+
+// Key of a patched class in the patch cache and the disk cache, which identifies the
+// original class bytes, the hooks applied to them and the suffix of the names generated
+// for them
+// NOTE: The class loader is not part of the key, so the copies of a class that are
+//       defined by many class loaders from the same bytes are only patched once
+static std::string
+get_patched_class_key(const std::string &clazz_name, const std::vector<u1> &original_bytes, const std::string &fingerprint)
+{
+        std::string hooks_id = clazz_name + "#" + fingerprint + "#" + get_names_uuid();
+        std::stringstream ss;
+
+        ss << std::hex << fnv1a(original_bytes.data(), original_bytes.size()) << "_" << fnv1a(hooks_id.data(), hooks_id.size());
+        return ss.str();
+}
+
+// Key that identifies a method inside of a class
+// NOTE: Descriptors always start with '(', so the key is unambiguous
+static inline std::string
+get_method_key(const std::string &name, const std::string &signature)
+{
+        return name + signature;
+}
+
+// Key that identifies the holder class of a hooked method for a kind of hook
+// NOTE: Holder classes are defined in the class loader of the hooked class
+static inline std::string
+get_holder_key(const class_id_t &clazz_id, const std::string &method_key, const std::string &kind)
+{
+        return get_class_key(clazz_id) + "." + method_key + "#" + kind;
 }
 
 static std::unique_ptr<method_info_t>
@@ -147,7 +653,7 @@ get_method_info(jvmtiEnv *jvmti, jmethodID method)
 static std::string
 get_copy_method_name(const std::string &method_name, const std::string& class_name)
 {
-        static std::string uuid = GenerateUuid();
+        auto &uuid = get_names_uuid();
         std::string clazz = class_name + "_";
         std::replace(clazz.begin(), clazz.end(), '/', '_');
         // init methods have additional "constructor" to not overlap possible method named init or clinit
@@ -163,7 +669,7 @@ get_copy_method_name(const std::string &method_name, const std::string& class_na
 static std::string
 get_copy_clone_name(const std::string& method_name, const std::string& class_name)
 {
-    static std::string uuid = GenerateUuid();
+    auto &uuid = get_names_uuid();
     std::string clazz = class_name + "_";
     std::replace(clazz.begin(), clazz.end(), '/', '_');
     // init methods have additional "constructor" to not overlap possible method named init or clinit
@@ -176,6 +682,44 @@ get_copy_clone_name(const std::string& method_name, const std::string& class_nam
     return method_name + "_clone_____jnihook_" + clazz + uuid;
 }
 
+// generates name for the exit probe of a method
+// NOTE: Every exit probe has the same descriptor, so the probes of overloaded
+//       methods are told apart by the hash of the method descriptor
+static std::string
+get_exit_probe_name(const std::string& method_name, const std::string& descriptor, const std::string& class_name)
+{
+        std::stringstream ss;
+
+        ss << method_name << "_exit_" << std::hex << fnv1a(descriptor.data(), descriptor.size());
+        return get_copy_method_name(ss.str(), class_name);
+}
+
+// Descriptor of the entry probe of a method, which takes the same parameters
+static inline std::string
+get_entry_probe_desc(const std::string& descriptor)
+{
+        return descriptor.substr(0, descriptor.find(')') + 1) + "V";
+}
+
+// generates name for a new holder class, in the same package as the hooked class
+// NOTE: The name only depends on the hooked method and the kind of hook, so that the
+//       patched classes that refer to it can be reused by the next runs (see
+//       `JNIHook_SetDiskCacheDirectory`). Defined classes are never unloaded, so the
+//       holders that are defined again with the same name (e.g. after `JNIHook_Shutdown`,
+//       or by another class loader) get a generation suffix.
+static std::string
+get_holder_class_name(const std::string& class_name, const std::string &method_key, const std::string &kind)
+{
+        auto &uuid = get_names_uuid();
+        std::string holder_id = class_name + "." + method_key + "#" + kind;
+        std::stringstream ss;
+
+        ss << class_name << "$$JNIHook_" << uuid << "_" << std::hex << fnv1a(holder_id.data(), holder_id.size());
+        if (auto generation = g_holder_generations[holder_id]++; generation > 0)
+                ss << "_" << std::dec << generation;
+        return ss.str();
+}
+
 static std::vector<ArgType> get_arg(const std::string& desc) {
     std::vector<ArgType> types;
     size_t cursor = 0;
@@ -239,6 +783,73 @@ static std::vector<ArgType> get_arg(const std::string& desc) {
     }
     return types;
 }
+static void
+ApplyDeferredHooks(jvmtiEnv *jvmti, const class_id_t &clazz_id, const std::vector<deferred_hook_t> &deferred_hooks,
+                   jint class_data_len, const unsigned char *class_data,
+                   jint *new_class_data_len, unsigned char **new_class_data);
+
+// Stores the original bytes of a class in the class cache, unless they're already cached
+static void
+cache_class_bytes(const class_id_t &clazz_id, jint class_data_len, const unsigned char *class_data)
+{
+        if (g_class_file_cache.contains(clazz_id))
+                return;
+
+        g_class_file_cache.insert(clazz_id, std::make_shared<std::vector<u1>>(class_data, class_data + class_data_len));
+}
+
+// Checks if the ClassFileLoadHook should cache the bytes of a class
+static bool
+should_cache_class(const hooks_snapshot_t &snapshot, std::string_view class_name, bool is_load)
+{
+        if (!is_load) {
+                std::lock_guard lock(g_class_caching_mutex);
+                return g_classes_being_cached.find(std::string(class_name)) != g_classes_being_cached.end();
+        }
+
+        auto &prefixes = snapshot.passive_caching_prefixes;
+        return std::any_of(prefixes.begin(), prefixes.end(), [class_name](const std::string &prefix) {
+                return class_name.starts_with(prefix);
+        });
+}
+
+// Publishes the current state that is read without locks (see `hooks_snapshot_t`)
+// NOTE: Must be called with `g_hooks_mutex` held, and it waits until no class
+//       loading thread uses the previous snapshot anymore
+static void
+publish_snapshot()
+{
+        auto snapshot = std::make_unique<hooks_snapshot_t>();
+
+        snapshot->deferred_hooks = g_deferred_hooks;
+        snapshot->passive_caching_prefixes = g_passive_caching_prefixes;
+
+        // A method may have holders of other kinds of hooks, which it no longer uses
+        std::unordered_map<std::string_view, const holder_t *> holders_by_name;
+        for (auto &[_key, holder] : g_holders)
+                holders_by_name[holder.name] = &holder;
+
+        {
+                std::lock_guard lock(g_method_hooks_mutex);
+
+                for (auto &[method, location] : g_method_hooks) {
+                        std::string holder_name;
+
+                        g_hooks.find(location.clazz_id, [&location, &holder_name](const class_hooks_t &class_hooks) {
+                                if (auto hook = class_hooks.find(location.method_key); hook != class_hooks.end())
+                                        holder_name = hook->second.holder_name;
+                        });
+                        if (holder_name.length() == 0)
+                                continue;
+
+                        if (auto holder = holders_by_name.find(holder_name); holder != holders_by_name.end())
+                                snapshot->holders[method] = *holder->second;
+                }
+        }
+
+        g_snapshot.publish(std::move(snapshot));
+}
+
 void JNICALL JNIHook_ClassFileLoadHook(jvmtiEnv *jvmti_env,
                                        JNIEnv* jni_env,
                                        jclass class_being_redefined,
@@ -250,401 +861,1178 @@ void JNICALL JNIHook_ClassFileLoadHook(jvmtiEnv *jvmti_env,
                                        jint* new_class_data_len,
                                        unsigned char** new_class_data)
 {
-        auto class_name = get_class_name(jni_env, class_being_redefined);
+        class_id_t clazz_id { -1, "" };
+        bool is_load = class_being_redefined == NULL;
+
+        // Lock-free, keeps the snapshot and JNIHook alive until the hook returns
+        auto snapshot = g_snapshot.read();
+        if (!snapshot)
+                return;
 
-        // Don't do anything for unhooked classes
-        // (unless g_force_class_caching is true)
-        if (class_name == "" || (g_hooks.find(class_name) == g_hooks.end() || g_hooks[class_name].size() == 0) && !g_force_class_caching)
+        // Most loaded classes have no hooks, so they are rejected before anything else
+        if (name && !g_hooked_classes_filter.may_contain(name) && !should_cache_class(*snapshot.get(), name, is_load))
                 return;
 
-        // Cache parsed ClassFile if it's not cached yet
-        if (g_class_file_cache.find(class_name) == g_class_file_cache.end()) {
-                auto cf = ClassFile::parse((u1 *)class_data, class_data_len);
-                if (!cf)
+        // Redefinitions only matter while `CacheClasses` retransforms classes
+        // NOTE: This also keeps the redefinitions done while the other threads are
+        //       suspended from waiting for the locks that those threads may hold
+        if (!is_load) {
+                std::lock_guard lock(g_class_caching_mutex);
+                if (g_classes_being_cached.size() == 0)
                         return;
+        }
 
-#ifdef JNIHOOK_DEBUG
-                // Assert that parsed class is the same as original class
-                auto bytes = cf->toBytes();
-                auto len = static_cast<jint>(bytes.size());
-                bool check = true;
-                if (len != class_data_len) {
-                        LOG("WARN: The parsed classfile length is not the same as the original (expected: %d, found: %d)\n", class_data_len, len);
-                        check = false;
-                }
-                len = std::min({ len, class_data_len });
-                for (jint i = 0; i < len; ++i) {
-                        auto byte = bytes[i];
-                        auto expected = class_data[i];
-                        if (byte != expected) {
-                                LOG("WARN: Class file byte '%d' differs from original (expected: %d, found: %d)\n", i, byte, expected);
-                                check = false;
-                        }
-                }
-                LOG("Class file parse check: %s\n", check ? "OK" : "BAD");
-                // cf->dump("/tmp/ORIG.class");
-#endif
-                g_class_file_cache[class_name] = std::move(cf);
+        // NOTE: The JVM passes the name of the class for loads, redefinitions and
+        //       retransformations. It can only be NULL for classes defined without
+        //       a name, which can't have hooks unless they are being redefined.
+        //       No Java code is called from here, so that classes can be defined
+        //       (e.g. by `env->DefineClass()`) while the hook is enabled.
+        if (name)
+                clazz_id = class_id_t { get_loader_id(jni_env, loader), name };
+        else if (class_being_redefined)
+                clazz_id = get_class_id(jni_env, class_being_redefined);
+
+        if (clazz_id.name == "" || clazz_id.loader < 0)
+                return;
+
+        // Patch classes with deferred hooks as they get loaded, in every class loader
+        if (auto deferred = snapshot->deferred_hooks.find(clazz_id.name); is_load && deferred != snapshot->deferred_hooks.end()) {
+                ApplyDeferredHooks(jvmti_env, clazz_id, deferred->second, class_data_len, class_data, new_class_data_len, new_class_data);
+                return;
         }
 
+        // Only cache the classes retransformed by `CacheClasses`, and the ones
+        // picked for passive caching as they load. Other redefinitions (e.g. the
+        // ones that apply the hooks) must not replace the original class bytes.
+        if (!should_cache_class(*snapshot.get(), clazz_id.name, is_load))
+                return;
+
+        // Cache the original class bytes if they're not cached yet
+        // NOTE: They are only parsed when the class gets patched (see `get_class_file`)
+        cache_class_bytes(clazz_id, class_data_len, class_data);
+
         return;
 }
 
-// Patches up a class with the current hooks (if any)
-// and redefines it using JVMTI
-jnihook_result_t
-ReapplyClass(jclass clazz, std::string clazz_name)
+static HookType
+get_hook_type(const std::string &method_name, std::optional<size_t> bytecode_offset, bool guarded = false, bool probe = false,
+              bool counter = false, bool sampled = false, bool filtered = false)
 {
-        jvmtiClassDefinition class_definition;
-        jvmtiError err;
-        auto cf = g_class_file_cache[clazz_name]->clone();
-
-        // Patch class file
-        // NOTE: The `methods` attribute only has the methods defined by the main class of this ClassFile
-        //       Method references are not included here
-        //       If the source file has more than one class, they are compiled as separate ClassFiles
-        for (auto &method : cf->methods) {
-                auto name = method.getName();
-                auto descriptor = method.getDesc();
-
-                // Check if the current method is a method that should be hooked
-                // TODO: Use hashmap for faster lookup
-                bool should_hook = false;
-                std::optional<size_t> bytecode_offset;
-                for (auto &hk_info : g_hooks[clazz_name]) {
-                        auto &minfo = hk_info.method_info;
-                        if (minfo.name == name && minfo.signature == descriptor) {
-                                should_hook = true;
-                                bytecode_offset = hk_info.bytecode_offset;
-                                break;
-                        }
-                }
-                if (!should_hook)
-                        continue;
+        if (filtered)
+                return HookType::Filtered;
+        else if (sampled)
+                return HookType::Sampled;
+        else if (counter)
+                return HookType::Counter;
+        else if (probe)
+                return HookType::Probe;
+        else if (guarded)
+                return HookType::Guarded;
+        else if (method_name == "<init>")
+                return HookType::Init;
+        else if (method_name == "<clinit>")
+                return HookType::ClInit;
+        else if (bytecode_offset)
+                return HookType::Bytecode;
+
+        return HookType::Native;
+}
 
-                HookType hookType = HookType::Native;
-                if (strcmp(name, "<init>") == 0) {
-                    hookType = HookType::Init;
-                }
-                else if (strcmp(name, "<clinit>") == 0) {
-                    hookType = HookType::ClInit;
-                }
-                else if (bytecode_offset) {
-                    hookType = HookType::Bytecode;
-                }
-                // New method
-                std::string newName = get_copy_method_name(name, cf->getThisClassName());
-                
-                u2 copyflags = Method::PRIVATE | Method::FINAL;
-                if (method.accessFlags & Method::STATIC) {
-                    copyflags |= Method::STATIC;
-                }
+static inline HookType
+get_hook_type(const hook_info_t &hook)
+{
+        return get_hook_type(hook.method_info.name, hook.bytecode_offset, hook.holder_name.length() > 0, hook.exit_probe.has_value(),
+                             hook.striped_counter.has_value(), hook.sampled, hook.filtered);
+}
 
-                auto deleteLNT = [](CodeAttr* orig_ca) {
-                    // remove line number table
-                    for (size_t i = 0; i < orig_ca->attrs.size(); i++) {
-                        if (orig_ca->attrs.attrs[i]->kind == ATTR_LNT) {
-                            orig_ca->attrs.remove(i);
-                        }
-                    }
-                };
-                
-                auto deleteNextInsts = [](InstList::Iterator& iterator) {
-                    // from JNIF model.cpp InstList::~InstList()
-                    for (Inst* inst = iterator->next; inst != nullptr;) {
-                        Inst* next = inst->next;
-                        inst->~Inst();
-                        inst = next;
-                    }
-                    iterator->next = nullptr;
-                };
-
-                // constructor hook
-                if (hookType == HookType::Init or 
-                    hookType == HookType::ClInit) {
-
-                    std::string copyName = get_copy_clone_name(name, cf->getThisClassName());
-                    auto& copyMethod = cf->addMethod(copyName.c_str(), descriptor, copyflags);
-                    auto& nativeMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
-
-
-                    for (size_t i = 0; i < method.attrs.size(); ++i) {
-                        auto& attr = method.attrs[i];
-                        if (attr.kind == ATTR_CODE) {
-                            u2 code_nameindex = 0;
-                            // get index of "Code" from ConstPool
-                            for (ConstPool::Iterator it = attr.constPool->iterator(); it.hasNext(); it++) {
-                                ConstPool::Index i = *it;
-                                ConstPool::Tag tag = attr.constPool->getTag(i);
-                                if (tag == ConstPool::Tag::UTF8) {
-                                    std::string bytes = attr.constPool->getUtf8(i);
-                                    if (bytes == "Code") {
-                                        code_nameindex = i;
-                                    }
-                                }
-                            }
+// Name of the method that keeps the original (unhooked) behavior of a hooked method
+static std::string
+get_original_method_name(HookType hook_type, const std::string &method_name, const std::string &clazz_name)
+{
+        switch (hook_type) {
+        case HookType::Init:
+        case HookType::ClInit:
+        case HookType::Guarded:
+        case HookType::Sampled:
+        case HookType::Filtered:
+            return get_copy_clone_name(method_name, clazz_name);
+        case HookType::Bytecode:
+        case HookType::Probe:
+        case HookType::Counter:
+            return method_name;
+        case HookType::Native:
+            break;
+        }
 
-                            CodeAttr* ca = cf->_arena.create<CodeAttr>(code_nameindex, cf.get());
-                            CodeAttr* orig_ca = ((CodeAttr*)&attr);
-                            InstList& instList = ca->instList;
-
-                            ca->maxStack = orig_ca->maxStack;
-                            ca->maxLocals = orig_ca->maxLocals;
-
-                            auto& orig_instList = orig_ca->instList;
-                            //copy constructor opcodes to copy method
-                            bool allow_copy = false;
-                            size_t varsize = 0;
-                            for (auto it = orig_instList.begin().operator++(); it != orig_instList.end(); it.operator++()) {
-                                if (allow_copy) {
-                                    instList.copy(*it);
-                                    continue;
-                                }
-                                if (it->isInvoke() or it->isInvokeDynamic() or it->isInvokeInterface()) {
-                                    allow_copy = true;
-                                }
-                                else {
-                                    varsize++;
-                                }
-                            }
+        return get_copy_method_name(method_name, clazz_name);
+}
 
-                            ca->codeLen = instList.size();
-                            ca->cfg = ((CodeAttr*)&attr)->cfg;
-                            copyMethod.attrs.add(ca);
-
-                            auto nativeMethodid = cf->addMethodRef(cf->thisClassIndex, newName.c_str(), descriptor);
-                            auto iterator = orig_instList.begin();
-                            if (hookType == HookType::Init) {
-                                //patch original <init>
-                                // skip empty begin and invoke
-                                iterator.operator++();//empty
-                                iterator.operator++();//invoke
-
-                                // +1 for each var
-                                for (int c = 0; c < varsize; c++) {
-                                    iterator.operator++();
-                                }
+// Patches a single method of a class file with its hook
+static jnihook_result_t
+PatchMethod(ClassFile *cf, Method &method, const hook_info_t &hook)
+{
+        auto name = method.getName();
+        auto descriptor = method.getDesc();
+        std::optional<size_t> bytecode_offset = hook.bytecode_offset;
 
-                                auto arg = get_arg(descriptor);
-                                orig_instList.addZero(Opcode::aload_0,*iterator);
-                                orig_ca->maxStack = orig_ca->maxStack + arg.size();
-
-                                int VarIndex = 1;
-                                for (size_t i = 0; i < arg.size();i++) {
-                                    auto& type = arg[i];
-                                    int ZeroOp = i+1;
-
-                                    if (i < 3) {
-                                        VarIndex += 1;
-                                        switch (type) {
-                                        case ArgType::Short: case ArgType::Byte: case ArgType::Char: case ArgType::Boolean: case ArgType::Int:
-                                            ZeroOp = static_cast<int>(Opcode::iload_0) + ZeroOp;
-                                            orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
-                                            break;
-                                        case ArgType::Float:
-                                            ZeroOp = static_cast<int>(Opcode::fload_0) + ZeroOp;
-                                            orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
-                                            break;
-                                        case ArgType::Object:
-                                            ZeroOp = static_cast<int>(Opcode::aload_0) + ZeroOp;
-                                            orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
-                                            break;
-                                        case ArgType::Double:
-                                            ZeroOp = static_cast<int>(Opcode::dload_0) + ZeroOp;
-                                            orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
-                                            break;
-                                        case ArgType::Long:
-                                            ZeroOp = static_cast<int>(Opcode::lload_0) + ZeroOp;
-                                            orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
-                                            break;
-                                        default:
-                                            return JNIHOOK_ERR_UNKNOWN;
-                                        }
-                                    }
-                                    else {
-                                        switch (type) {
-                                        case ArgType::Short: case ArgType::Byte: case ArgType::Char: case ArgType::Boolean: case ArgType::Int:
-                                            orig_instList.addVar(Opcode::iload, VarIndex, *iterator);
-                                            VarIndex += 1;
-                                            break;
-                                        case ArgType::Float:
-                                            orig_instList.addVar(Opcode::fload, VarIndex, *iterator);
-                                            VarIndex += 1;
-                                            break;
-                                        case ArgType::Object:
-                                            orig_instList.addVar(Opcode::aload, VarIndex, *iterator);
-                                            VarIndex += 1;
-                                            break;
-                                        case ArgType::Long:
-                                            orig_instList.addVar(Opcode::lload, VarIndex, *iterator);
-                                            VarIndex += 2;
-                                            break;
-                                        case ArgType::Double:
-                                            VarIndex += 2;
-                                            orig_instList.addVar(Opcode::dload, VarIndex, *iterator);
-                                            break;
-                                        default:
-                                            return JNIHOOK_ERR_UNKNOWN;
-                                        }
-                                    }
-                                }
-                                deleteNextInsts(iterator);
-                                orig_instList.addInvoke(Opcode::invokespecial, nativeMethodid, *iterator); // this.nativeMethod()
-                                orig_instList.addZero(Opcode::RETURN, *iterator);                         // return
+        HookType hookType = get_hook_type(hook);
+        // New method
+        std::string newName = get_copy_method_name(name, cf->getThisClassName());
+        
+        u2 copyflags = Method::PRIVATE | Method::FINAL;
+        if (method.accessFlags & Method::STATIC) {
+            copyflags |= Method::STATIC;
+        }
 
-                                orig_ca->codeLen = orig_instList.size();
-                            }
-                            else if (hookType == HookType::ClInit) {
-                                //patch original <clinit>
-                                deleteNextInsts(iterator);
-                                orig_instList.addInvoke(Opcode::invokestatic, nativeMethodid, *iterator); // nativeMethod()
-                                orig_instList.addZero(Opcode::RETURN, *iterator);                        // return
+        auto deleteLNT = [](CodeAttr* orig_ca) {
+            // remove line number table
+            for (size_t i = 0; i < orig_ca->attrs.size(); i++) {
+                if (orig_ca->attrs.attrs[i]->kind == ATTR_LNT) {
+                    orig_ca->attrs.remove(i);
+                }
+            }
+        };
+        
+        auto deleteNextInsts = [](InstList::Iterator& iterator) {
+            // from JNIF model.cpp InstList::~InstList()
+            for (Inst* inst = iterator->next; inst != nullptr;) {
+                Inst* next = inst->next;
+                inst->~Inst();
+                inst = next;
+            }
+            iterator->next = nullptr;
+        };
+
+        // constructor hook
+        if (hookType == HookType::Init or 
+            hookType == HookType::ClInit) {
+
+            std::string copyName = get_copy_clone_name(name, cf->getThisClassName());
+            auto& copyMethod = cf->addMethod(copyName.c_str(), descriptor, copyflags);
+            auto& nativeMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
+
+
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                auto& attr = method.attrs[i];
+                if (attr.kind == ATTR_CODE) {
+                    u2 code_nameindex = 0;
+                    // get index of "Code" from ConstPool
+                    for (ConstPool::Iterator it = attr.constPool->iterator(); it.hasNext(); it++) {
+                        ConstPool::Index i = *it;
+                        ConstPool::Tag tag = attr.constPool->getTag(i);
+                        if (tag == ConstPool::Tag::UTF8) {
+                            std::string bytes = attr.constPool->getUtf8(i);
+                            if (bytes == "Code") {
+                                code_nameindex = i;
                             }
-                            deleteLNT(orig_ca);
+                        }
+                    }
+
+                    CodeAttr* ca = cf->_arena.create<CodeAttr>(code_nameindex, cf);
+                    CodeAttr* orig_ca = ((CodeAttr*)&attr);
+                    InstList& instList = ca->instList;
+
+                    ca->maxStack = orig_ca->maxStack;
+                    ca->maxLocals = orig_ca->maxLocals;
+
+                    auto& orig_instList = orig_ca->instList;
+                    //copy constructor opcodes to copy method
+                    bool allow_copy = false;
+                    size_t varsize = 0;
+                    for (auto it = orig_instList.begin().operator++(); it != orig_instList.end(); it.operator++()) {
+                        if (allow_copy) {
+                            instList.copy(*it);
+                            continue;
+                        }
+                        if (it->isInvoke() or it->isInvokeDynamic() or it->isInvokeInterface()) {
+                            allow_copy = true;
                         }
                         else {
-                            copyMethod.attrs.add((Attr*)&attr);
-                            nativeMethod.attrs.add((Attr*)&attr);
+                            varsize++;
                         }
                     }
-                    *(u2*)&nativeMethod.accessFlags |= Method::NATIVE;
-                }
-                // mid function hook
-                else if (hookType == HookType::Bytecode) {
-                    /*
-                        if midfunction hook
-                        make native method to store hook
-                        invoke native method at specified offset
-                        how offset works:
-                        1-beginning of function
-                        n-each instruction is +1
-                    */
-                    auto& nativeMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
-                    
-                    for (size_t i = 0; i < method.attrs.size(); ++i) {
-                        auto& attr = method.attrs[i];
-                        nativeMethod.attrs.add((Attr*)&attr); // native method should inherit all the attributes
-                        if (attr.kind == ATTR_CODE) {
-                            nativeMethod.attrs.remove(i);
-                            u2 code_nameindex = 0;
-                            // get index of "Code" from ConstPool
-                            for (ConstPool::Iterator it = attr.constPool->iterator(); it.hasNext(); it++) {
-                                ConstPool::Index i = *it;
-                                ConstPool::Tag tag = attr.constPool->getTag(i);
-                                if (tag == 1) {
-                                    std::string bytes = attr.constPool->getUtf8(i);
-                                    if (bytes == "Code") {
-                                        code_nameindex = i;
-                                    }
-                                }
-                            }
 
-                            CodeAttr* orig_ca = ((CodeAttr*)&attr);
-                            InstList& instList = orig_ca->instList;
+                    ca->codeLen = instList.size();
+                    ca->cfg = ((CodeAttr*)&attr)->cfg;
+                    copyMethod.attrs.add(ca);
+
+                    auto nativeMethodid = cf->addMethodRef(cf->thisClassIndex, newName.c_str(), descriptor);
+                    auto iterator = orig_instList.begin();
+                    if (hookType == HookType::Init) {
+                        //patch original <init>
+                        // skip empty begin and invoke
+                        iterator.operator++();//empty
+                        iterator.operator++();//invoke
+
+                        // +1 for each var
+                        for (int c = 0; c < varsize; c++) {
+                            iterator.operator++();
+                        }
 
-                            auto nativeMethodid = cf->addMethodRef(cf->thisClassIndex, newName.c_str(), descriptor);
-                            auto iterator = instList.begin();
-                            
-                            for (size_t i = 0; i < bytecode_offset.value(); i++) {
-                                if (iterator->next == nullptr) {
+                        auto arg = get_arg(descriptor);
+                        orig_instList.addZero(Opcode::aload_0,*iterator);
+                        orig_ca->maxStack = orig_ca->maxStack + arg.size();
+
+                        int VarIndex = 1;
+                        for (size_t i = 0; i < arg.size();i++) {
+                            auto& type = arg[i];
+                            int ZeroOp = i+1;
+
+                            if (i < 3) {
+                                VarIndex += 1;
+                                switch (type) {
+                                case ArgType::Short: case ArgType::Byte: case ArgType::Char: case ArgType::Boolean: case ArgType::Int:
+                                    ZeroOp = static_cast<int>(Opcode::iload_0) + ZeroOp;
+                                    orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
+                                    break;
+                                case ArgType::Float:
+                                    ZeroOp = static_cast<int>(Opcode::fload_0) + ZeroOp;
+                                    orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
                                     break;
+                                case ArgType::Object:
+                                    ZeroOp = static_cast<int>(Opcode::aload_0) + ZeroOp;
+                                    orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
+                                    break;
+                                case ArgType::Double:
+                                    ZeroOp = static_cast<int>(Opcode::dload_0) + ZeroOp;
+                                    orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
+                                    break;
+                                case ArgType::Long:
+                                    ZeroOp = static_cast<int>(Opcode::lload_0) + ZeroOp;
+                                    orig_instList.addZero(static_cast<Opcode>(ZeroOp), *iterator);
+                                    break;
+                                default:
+                                    return JNIHOOK_ERR_UNKNOWN;
                                 }
-                                iterator.operator++();
                             }
-                            // instead of forcing all midhooks to be ()V increase max stack to prevent error defining
-                            // (returntype) (var) = this.nativeMethod();
-                            orig_ca->maxStack++;
-                            if (copyflags & Method::STATIC) {
-                                instList.addInvoke(Opcode::invokestatic, nativeMethodid, *iterator); // nativeMethod()
-                            }else {
-                                instList.addZero(Opcode::aload_0, *iterator);                          // this=this
-                                instList.addInvoke(Opcode::invokespecial, nativeMethodid, *iterator); // this.nativeMethod()
+                            else {
+                                switch (type) {
+                                case ArgType::Short: case ArgType::Byte: case ArgType::Char: case ArgType::Boolean: case ArgType::Int:
+                                    orig_instList.addVar(Opcode::iload, VarIndex, *iterator);
+                                    VarIndex += 1;
+                                    break;
+                                case ArgType::Float:
+                                    orig_instList.addVar(Opcode::fload, VarIndex, *iterator);
+                                    VarIndex += 1;
+                                    break;
+                                case ArgType::Object:
+                                    orig_instList.addVar(Opcode::aload, VarIndex, *iterator);
+                                    VarIndex += 1;
+                                    break;
+                                case ArgType::Long:
+                                    orig_instList.addVar(Opcode::lload, VarIndex, *iterator);
+                                    VarIndex += 2;
+                                    break;
+                                case ArgType::Double:
+                                    VarIndex += 2;
+                                    orig_instList.addVar(Opcode::dload, VarIndex, *iterator);
+                                    break;
+                                default:
+                                    return JNIHOOK_ERR_UNKNOWN;
+                                }
                             }
-                            deleteLNT(orig_ca);
                         }
-                    }
+                        deleteNextInsts(iterator);
+                        orig_instList.addInvoke(Opcode::invokespecial, nativeMethodid, *iterator); // this.nativeMethod()
+                        orig_instList.addZero(Opcode::RETURN, *iterator);                         // return
 
-                    *(u2*)&nativeMethod.accessFlags |= Method::NATIVE;
+                        orig_ca->codeLen = orig_instList.size();
+                    }
+                    else if (hookType == HookType::ClInit) {
+                        //patch original <clinit>
+                        deleteNextInsts(iterator);
+                        orig_instList.addInvoke(Opcode::invokestatic, nativeMethodid, *iterator); // nativeMethod()
+                        orig_instList.addZero(Opcode::RETURN, *iterator);                        // return
+                    }
+                    deleteLNT(orig_ca);
                 }
                 else {
-                    // default hook
-                    auto& newMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
-
-                    // Set method to native
-                    *(u2*)&method.accessFlags |= Method::NATIVE;
-
-                    // Remove "Code" attribute
-                    for (size_t i = 0; i < method.attrs.size(); ++i) {
-                        auto& attr = method.attrs[i];
-                        newMethod.attrs.add((Attr*)&attr); // native method should inherit all the attributes
-                                                          // from the original method
-                        if (attr.kind == ATTR_CODE) {
-                            method.attrs.remove(i);
+                    copyMethod.attrs.add((Attr*)&attr);
+                    nativeMethod.attrs.add((Attr*)&attr);
+                }
+            }
+            *(u2*)&nativeMethod.accessFlags |= Method::NATIVE;
+        }
+        // mid function hook
+        else if (hookType == HookType::Bytecode) {
+            /*
+                if midfunction hook
+                make native method to store hook
+                invoke native method at specified offset
+                how offset works:
+                1-beginning of function
+                n-each instruction is +1
+            */
+            auto& nativeMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
+            
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                auto& attr = method.attrs[i];
+                nativeMethod.attrs.add((Attr*)&attr); // native method should inherit all the attributes
+                if (attr.kind == ATTR_CODE) {
+                    nativeMethod.attrs.remove(i);
+                    u2 code_nameindex = 0;
+                    // get index of "Code" from ConstPool
+                    for (ConstPool::Iterator it = attr.constPool->iterator(); it.hasNext(); it++) {
+                        ConstPool::Index i = *it;
+                        ConstPool::Tag tag = attr.constPool->getTag(i);
+                        if (tag == 1) {
+                            std::string bytes = attr.constPool->getUtf8(i);
+                            if (bytes == "Code") {
+                                code_nameindex = i;
+                            }
+                        }
+                    }
+
+                    CodeAttr* orig_ca = ((CodeAttr*)&attr);
+                    InstList& instList = orig_ca->instList;
+
+                    auto nativeMethodid = cf->addMethodRef(cf->thisClassIndex, newName.c_str(), descriptor);
+                    auto iterator = instList.begin();
+                    
+                    for (size_t i = 0; i < bytecode_offset.value(); i++) {
+                        if (iterator->next == nullptr) {
                             break;
                         }
+                        iterator.operator++();
                     }
+                    // instead of forcing all midhooks to be ()V increase max stack to prevent error defining
+                    // (returntype) (var) = this.nativeMethod();
+                    orig_ca->maxStack++;
+                    if (copyflags & Method::STATIC) {
+                        instList.addInvoke(Opcode::invokestatic, nativeMethodid, *iterator); // nativeMethod()
+                    }else {
+                        instList.addZero(Opcode::aload_0, *iterator);                          // this=this
+                        instList.addInvoke(Opcode::invokespecial, nativeMethodid, *iterator); // this.nativeMethod()
+                    }
+                    deleteLNT(orig_ca);
                 }
+            }
+
+            *(u2*)&nativeMethod.accessFlags |= Method::NATIVE;
         }
+        // guarded hook (or sampled and filtered hooks, which only have another holder class)
+        else if (hookType == HookType::Guarded || hookType == HookType::Sampled || hookType == HookType::Filtered) {
+            /*
+                the original code is moved to a clone method, and the hooked method
+                just forwards its arguments to the 'dispatch' method of the holder class,
+                which checks the guard and calls either the native method or the clone
+                the holder class calls the clone and the native method, so they can't be private
+                the injected code has no branches, so no StackMapTable frames are needed
+            */
+            bool isStatic = (copyflags & Method::STATIC) != 0;
+            u2 guardflags = (copyflags & ~Method::PRIVATE) | Method::SYNTHETIC;
+            method_desc_t desc;
+
+            if (!ParseMethodDesc(descriptor, desc))
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
 
-        // Redefine class with modified ClassFile
-        auto cf_bytes = cf->toBytes();
+            std::string copyName = get_copy_clone_name(name, cf->getThisClassName());
+            auto& copyMethod = cf->addMethod(copyName.c_str(), descriptor, guardflags);
+            auto& nativeMethod = cf->addMethod(newName.c_str(), descriptor, guardflags | Method::NATIVE);
+
+            CodeAttr* orig_ca = nullptr;
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                auto& attr = method.attrs[i];
+                copyMethod.attrs.add((Attr*)&attr); // the clone inherits all the attributes from the original method
+                if (attr.kind == ATTR_CODE)
+                    orig_ca = (CodeAttr*)&attr;
+                else
+                    nativeMethod.attrs.add((Attr*)&attr);
+            }
+
+            if (!orig_ca)
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
 
-        class_definition.klass = clazz;
-        class_definition.class_byte_count = cf_bytes.size();
-        class_definition.class_bytes = cf_bytes.data();
-        err = g_jnihook->jvmti->RedefineClasses(1, &class_definition);
-        std::stringstream ss;
-        LOG("===== CLASS REAPPLIED =====\n");
-        ss << *cf;
-        LOG("%s\n", ss.str().c_str());
-        LOG("===========================\n");
-        if (err != JVMTI_ERROR_NONE) {
-                LOG("ERR: JVMTI error in ReapplyClass: %d\n", err);
-                // cf->dump("/tmp/DUMP.class");
-                return JNIHOOK_ERR_JVMTI_OPERATION;
+            // Remove "Code" attribute
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                if (method.attrs[i].kind == ATTR_CODE) {
+                    method.attrs.remove(i);
+                    break;
+                }
+            }
+
+            // return Holder.dispatch([this,] args...);
+            CodeAttr* ca = cf->_arena.create<CodeAttr>(orig_ca->nameIndex, cf);
+            InstList& instList = ca->instList;
+            u2 slots = 0;
+
+            if (!isStatic)
+                instList.addVar(Opcode::aload, slots++);
+
+            for (auto& param : desc.params) {
+                instList.addVar(static_cast<Opcode>(GetLoadOpcode(param)), slots);
+                slots += GetTypeSlots(param);
+            }
+
+            auto holderIndex = cf->addClass(hook.holder_name.c_str());
+            auto dispatchDesc = GetDispatchDesc(cf->getThisClassName(), descriptor, isStatic);
+            instList.addInvoke(Opcode::invokestatic, cf->addMethodRef(holderIndex, "dispatch", dispatchDesc.c_str()));
+            instList.addZero(static_cast<Opcode>(GetReturnOpcode(desc.ret)));
+
+            ca->maxStack = std::max<u2>(slots, GetTypeSlots(desc.ret));
+            ca->maxLocals = slots;
+            ca->codeLen = instList.size();
+            method.attrs.add(ca);
         }
+        // probe hook
+        else if (hookType == HookType::Probe) {
+            /*
+                the original code stays in place, and native probes are called at the
+                start of the method and before every return and athrow that leaves it, without
+                going through a native replacement of the whole method
+                the entry probe takes the arguments of the method, the exit probe takes nothing
+                the injected code has no branches and leaves the stack as it was, so the
+                StackMapTable frames stay valid
+                exceptions thrown by the methods that are called leave without the exit probe,
+                and so do the ones thrown inside the range of an exception handler, which may
+                be caught by the method itself
+            */
+            bool isStatic = (copyflags & Method::STATIC) != 0;
+            Opcode invoke = isStatic ? Opcode::invokestatic : Opcode::invokespecial;
+            method_desc_t desc;
+
+            if (!ParseMethodDesc(descriptor, desc))
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
 
-        return JNIHOOK_OK;
-}
+            CodeAttr* ca = nullptr;
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                if (method.attrs[i].kind == ATTR_CODE)
+                    ca = (CodeAttr*)&method.attrs[i];
+            }
 
-// Stores a loaded class in the class cache
-jnihook_result_t
-CacheClass(JNIEnv *env, jclass clazz)
-{
-        std::string clazz_name = get_class_name(env, clazz);
+            if (!ca)
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
 
-        if (g_class_file_cache.find(clazz_name) == g_class_file_cache.end()) {
-                if (g_jnihook->jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL) != JVMTI_ERROR_NONE) {
-                        LOG("ERR: Failed to enable class file load hook\n");
-                        return JNIHOOK_ERR_SETUP_CLASS_FILE_LOAD_HOOK;
+            // +1 for each handler range that starts at a label, -1 for each one that ends there
+            std::unordered_map<const Inst*, int> rangeBounds;
+            for (auto& handler : ca->exceptions) {
+                ++rangeBounds[handler.startpc];
+                --rangeBounds[handler.endpc];
+            }
+
+            InstList& instList = ca->instList;
+            std::vector<Inst*> exits;
+            int ranges = 0; // Handler ranges covering the current instruction
+            for (auto it = instList.begin(); it != instList.end(); ++it) {
+                if (it->isLabel()) {
+                    if (auto bound = rangeBounds.find(*it); bound != rangeBounds.end())
+                        ranges += bound->second;
+                    continue;
                 }
 
-                // Enable forceful caching of classfiles
-                // WARN: If something goes wrong, every class
-                // that goes through the ClassFileLoadHook
-                // would get cached! May waste a ton of memory.
-                g_force_class_caching = true;
-                auto result = g_jnihook->jvmti->RetransformClasses(1, &clazz);
-                g_force_class_caching = false;
-
-                // NOTE: We disable the ClassFileLoadHook here because it breaks
-                //       any `env->DefineClass()` calls. Also, it's not necessary
-                //       to keep it active at all times, we just have to use it for caching
-                //       classes that havent been cached yet.
-                // TODO: Investigate why it breaks it (possibly NullPointerException in
-                //       JNIHook_ClassFileLoadHook)
-                if (g_jnihook->jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL) != JVMTI_ERROR_NONE) {
-                        LOG("ERR: Failed to disable class file load hook\n");
-                        return JNIHOOK_ERR_SETUP_CLASS_FILE_LOAD_HOOK;
+                switch (it->opcode) {
+                case Opcode::ireturn: case Opcode::lreturn: case Opcode::freturn: case Opcode::dreturn:
+                case Opcode::areturn: case Opcode::RETURN:
+                    exits.push_back(*it);
+                    break;
+                case Opcode::athrow:
+                    if (ranges == 0)
+                        exits.push_back(*it);
+                    break;
+                default:
+                    break;
                 }
+            }
 
-                if (result != JVMTI_ERROR_NONE) {
-                        LOG("ERR: Failed to cache classfile (JVMTI error)\n");
-                        return JNIHOOK_ERR_CLASS_FILE_CACHE;
-                }
+            // [this.]entryProbe(args...);
+            if (hook.native_hook_method) {
+                auto entryDesc = get_entry_probe_desc(descriptor);
+                cf->addMethod(newName.c_str(), entryDesc.c_str(), copyflags | Method::NATIVE);
 
-                if (g_class_file_cache.find(clazz_name) == g_class_file_cache.end()) {
-                        LOG("ERR: Failed to cache classfile\n");
+                auto entryIndex = cf->addMethodRef(cf->thisClassIndex, newName.c_str(), entryDesc.c_str());
+                Inst* first = *instList.begin();
+                u2 slots = 0;
+
+                if (!isStatic)
+                    instList.addVar(Opcode::aload, slots++, first);
+
+                for (auto& param : desc.params) {
+                    instList.addVar(static_cast<Opcode>(GetLoadOpcode(param)), slots, first);
+                    slots += GetTypeSlots(param);
+                }
+
+                instList.addInvoke(invoke, entryIndex, first);
+                ca->maxStack = std::max<u2>(ca->maxStack, slots);
+            }
+
+            // [this.]exitProbe(); return/athrow
+            // NOTE: For instance methods, this relies on the local variable 0 still
+            //       holding `this`, which is the case for code compiled by javac
+            if (*hook.exit_probe) {
+                auto exitName = get_exit_probe_name(name, descriptor, cf->getThisClassName());
+                cf->addMethod(exitName.c_str(), "()V", copyflags | Method::NATIVE);
+
+                auto exitIndex = cf->addMethodRef(cf->thisClassIndex, exitName.c_str(), "()V");
+                for (auto exit : exits) {
+                    if (!isStatic)
+                        instList.addZero(Opcode::aload_0, exit);
+                    instList.addInvoke(invoke, exitIndex, exit);
+                }
+
+                if (!isStatic)
+                    ca->maxStack++; // `this` goes on top of the returned value
+            }
+
+            deleteLNT(ca);
+        }
+        // counter hook
+        else if (hookType == HookType::Counter) {
+            /*
+                the original code stays in place, and the counter of the holder class is
+                incremented at the start of the method, without any native code
+                a plain counter is a 'static long' incremented without synchronization, so
+                concurrent calls may be lost, while a striped counter is a LongAdder
+                the injected code has no branches, so the StackMapTable frames stay valid
+            */
+            CodeAttr* ca = nullptr;
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                if (method.attrs[i].kind == ATTR_CODE)
+                    ca = (CodeAttr*)&method.attrs[i];
+            }
+
+            if (!ca)
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
+
+            InstList& instList = ca->instList;
+            Inst* first = *instList.begin();
+            auto holderIndex = cf->addClass(hook.holder_name.c_str());
+
+            if (*hook.striped_counter) {
+                // Holder.adder.increment();
+                auto adderIndex = cf->addFieldRef(holderIndex, "adder", HOLDER_LONG_ADDER_DESC);
+                auto incrementIndex = cf->addMethodRef(cf->addClass(HOLDER_LONG_ADDER_CLASS), "increment", "()V");
+
+                instList.addField(Opcode::getstatic, adderIndex, first);
+                instList.addInvoke(Opcode::invokevirtual, incrementIndex, first);
+                ca->maxStack = std::max<u2>(ca->maxStack, 1);
+            } else {
+                // Holder.count += 1;
+                auto countIndex = cf->addFieldRef(holderIndex, "count", "J");
+
+                instList.addField(Opcode::getstatic, countIndex, first);
+                instList.addZero(Opcode::lconst_1, first);
+                instList.addZero(Opcode::ladd, first);
+                instList.addField(Opcode::putstatic, countIndex, first);
+                ca->maxStack = std::max<u2>(ca->maxStack, 4);
+            }
+
+            deleteLNT(ca);
+        }
+        else {
+            // default hook
+            auto& newMethod = cf->addMethod(newName.c_str(), descriptor, copyflags);
+
+            // Set method to native
+            *(u2*)&method.accessFlags |= Method::NATIVE;
+
+            // Remove "Code" attribute
+            for (size_t i = 0; i < method.attrs.size(); ++i) {
+                auto& attr = method.attrs[i];
+                newMethod.attrs.add((Attr*)&attr); // native method should inherit all the attributes
+                                                  // from the original method
+                if (attr.kind == ATTR_CODE) {
+                    method.attrs.remove(i);
+                    break;
+                }
+            }
+        }
+
+        return JNIHOOK_OK;
+}
+
+// Parses the original bytes of a class
+// NOTE: Doesn't touch any shared state, so classes can be parsed in parallel
+static std::shared_ptr<ClassFile>
+parse_class_file(std::vector<u1> &class_bytes)
+{
+        auto class_data = class_bytes.data();
+        auto class_data_len = static_cast<jint>(class_bytes.size());
+        std::shared_ptr<ClassFile> cf = ClassFile::parse(class_data, class_data_len);
+        if (!cf)
+                return nullptr;
+
+#ifdef JNIHOOK_DEBUG
+        // Assert that parsed class is the same as original class
+        auto bytes = cf->toBytes();
+        auto len = static_cast<jint>(bytes.size());
+        bool check = true;
+        if (len != class_data_len) {
+                LOG("WARN: The parsed classfile length is not the same as the original (expected: %d, found: %d)\n", class_data_len, len);
+                check = false;
+        }
+        len = std::min({ len, class_data_len });
+        for (jint i = 0; i < len; ++i) {
+                auto byte = bytes[i];
+                auto expected = class_data[i];
+                if (byte != expected) {
+                        LOG("WARN: Class file byte '%d' differs from original (expected: %d, found: %d)\n", i, byte, expected);
+                        check = false;
+                }
+        }
+        LOG("Class file parse check: %s\n", check ? "OK" : "BAD");
+        // cf->dump("/tmp/ORIG.class");
+#endif
+
+        return cf;
+}
+
+// Gets the parsed form of a cached class, parsing its original bytes if needed
+// NOTE: The returned class file stays valid even if it gets evicted meanwhile
+static std::shared_ptr<ClassFile>
+get_class_file(const class_id_t &clazz_id)
+{
+        auto cached = g_class_file_cache.get(clazz_id);
+        if (!cached)
+                return nullptr;
+
+        auto parsed_key = get_class_key(clazz_id);
+        if (auto parsed = g_parsed_class_cache.get(parsed_key); parsed)
+                return parsed->cf;
+
+        auto cf = parse_class_file(**cached);
+        if (!cf)
+                return nullptr;
+
+        g_parsed_class_cache.put(parsed_key, parsed_class_t { cf }, (*cached)->size());
+
+        return cf;
+}
+
+// Looks up a class patched with a set of hooks in the patched class cache, then in the
+// disk cache, which skips parsing, patching and serializing the class
+// NOTE: On a miss, `patched_key` receives the key to store the patched class with.
+//       Misses are counted by `PatchClass`, which is the one that has to patch the class.
+static bool
+get_cached_patched_class(const class_id_t &clazz_id, const class_hooks_t &hooks,
+                         std::vector<u1> &class_bytes, std::string *patched_key = nullptr)
+{
+        auto original = g_class_file_cache.get(clazz_id);
+        if (!original)
+                return false;
+
+        auto key = get_patched_class_key(clazz_id.name, **original, get_hooks_fingerprint(hooks));
+        if (patched_key)
+                *patched_key = key;
+
+        if (auto cached_bytes = g_patch_cache.get(key); cached_bytes) {
+                LOG("Patched class cache hit: %s (%s)\n", clazz_id.name.c_str(), key.c_str());
+                ++g_patch_cache_hits;
+                class_bytes = *cached_bytes;
+                return true;
+        }
+
+        if (!g_disk_cache.is_open() || !g_disk_cache.get(key, class_bytes))
+                return false;
+
+        LOG("Disk cache hit: %s (%s)\n", clazz_id.name.c_str(), key.c_str());
+        ++g_disk_cache_hits;
+        g_patch_cache.put(key, class_bytes, class_bytes.size());
+
+        return true;
+}
+
+// Clones, patches and serializes a class that missed the patched class caches
+// NOTE: Only touches the class file of its own class, so the jobs of different
+//       classes can run in parallel (see `PatchClasses`). The last patched class
+//       file is kept around, so that new hooks can be applied incrementally instead
+//       of patching the whole class again. If a hook was removed or changed, the
+//       class file is patched from scratch.
+static void
+run_patch_job(patch_job_t &job)
+{
+        auto &patched = job.patched;
+        class_hooks_t pending; // Hooks that aren't applied to the patched class file yet
+
+        // NOTE: Exceptions become the result of the job, so that they don't escape
+        //       `ReapplyClasses` while the other threads are suspended
+        try {
+                if (!job.incremental) {
+                        if (!job.cf && job.original) {
+                                job.cf = parse_class_file(*job.original);
+                                job.parsed = job.cf != nullptr;
+                        }
+
+                        if (!job.cf) {
+                                LOG("ERR: Failed to parse cached class: %s\n", job.clazz_id.name.c_str());
+                                patched.cf = nullptr;
+                                patched.applied.clear();
+                                job.result = JNIHOOK_ERR_CLASS_FILE_FORMAT;
+                                return;
+                        }
+
+                        patched.cf = job.cf->clone();
+                        patched.applied.clear();
+                }
+
+                for (auto &[key, hook] : job.hooks) {
+                        if (patched.applied.find(key) == patched.applied.end())
+                                pending.insert({ key, hook });
+                }
+
+                // Patch class file
+                // NOTE: The `methods` attribute only has the methods defined by the main class of this ClassFile
+                //       Method references are not included here
+                //       If the source file has more than one class, they are compiled as separate ClassFiles
+                for (auto &method : patched.cf->methods) {
+                        if (pending.size() == 0)
+                                break;
+
+                        // Check if the current method is a method that should be hooked
+                        auto hook = pending.find(get_method_key(method.getName(), method.getDesc()));
+                        if (hook == pending.end())
+                                continue;
+
+                        if (auto result = PatchMethod(patched.cf.get(), method, hook->second); result != JNIHOOK_OK) {
+                                // The class file may be partially patched, so it can't be reused
+                                patched.cf = nullptr;
+                                patched.applied.clear();
+                                job.result = result;
+                                return;
+                        }
+
+                        patched.applied.insert(*hook);
+                        pending.erase(hook);
+                }
+
+                *job.class_bytes = patched.cf->toBytes();
+        } catch (jnif::Exception ex) {
+                LOG("ERR: JNIF exception thrown while patching class '%s' -> %s\n", job.clazz_id.name.c_str(), ex.message.c_str());
+                patched.cf = nullptr;
+                patched.applied.clear();
+                job.result = JNIHOOK_ERR_CLASS_FILE_FORMAT;
+                return;
+        } catch (...) {
+                LOG("ERR: Unhandled exception thrown while patching class '%s'\n", job.clazz_id.name.c_str());
+                patched.cf = nullptr;
+                patched.applied.clear();
+                job.result = JNIHOOK_ERR_UNKNOWN;
+                return;
+        }
+#ifdef JNIHOOK_DEBUG
+        std::stringstream ss;
+        LOG("===== CLASS PATCHED (%s) =====\n", job.incremental ? "incremental" : "full");
+        ss << *patched.cf;
+        LOG("%s\n", ss.str().c_str());
+        LOG("=========================\n");
+#endif
+
+        job.result = JNIHOOK_OK;
+}
+
+// Patches up a list of classes with the current hooks (if any)
+// and serializes the results into `class_bytes`
+// NOTE: The caches are looked up and filled on the calling thread, while the classes
+//       that have to be patched are handed to `run_patch_job` in parallel. Copies of
+//       a class that share a patched class key are only patched once.
+//       Must be called with `g_patch_mutex` held.
+static jnihook_result_t
+PatchClasses(const std::vector<class_id_t> &clazz_ids, std::vector<std::vector<u1>> &class_bytes)
+{
+        std::vector<patch_job_t> jobs;
+        std::unordered_map<std::string, size_t> jobs_by_key;
+        std::vector<std::pair<size_t, size_t>> duplicates; // Index of the class and its job
+
+        class_bytes.resize(clazz_ids.size());
+        jobs.reserve(clazz_ids.size());
+        for (size_t i = 0; i < clazz_ids.size(); ++i) {
+                auto &clazz_id = clazz_ids[i];
+                auto hooks = g_hooks.get(clazz_id).value_or(class_hooks_t {});
+                std::string patched_key;
+
+                if (get_cached_patched_class(clazz_id, hooks, class_bytes[i], &patched_key))
+                        continue;
+
+                if (auto job = jobs_by_key.find(patched_key); patched_key.length() > 0 && job != jobs_by_key.end()) {
+                        ++g_patch_cache_hits; // It would be found in the cache once its job is done
+                        duplicates.push_back({ i, job->second });
+                        continue;
+                }
+
+                ++g_patch_cache_misses;
+                if (g_disk_cache.is_open())
+                        ++g_disk_cache_misses;
+
+                // The last patched version is taken out of the cache while its job patches it,
+                // and only put back if the job succeeds
+                parsed_class_t patched;
+                auto patched_cf_key = get_patched_class_file_key(clazz_id);
+                if (auto cached = g_parsed_class_cache.get(patched_cf_key); cached) {
+                        patched = std::move(*cached);
+                        g_parsed_class_cache.erase(patched_cf_key);
+                }
+
+                bool incremental = patched.cf != nullptr;
+                for (auto &[key, applied_hook] : patched.applied) {
+                        auto hook = hooks.find(key);
+                        if (hook == hooks.end() || !same_patch(hook->second, applied_hook)) {
+                                incremental = false;
+                                break;
+                        }
+                }
+
+                patch_job_t job = { clazz_id, std::move(hooks), patched_key, std::move(patched), &class_bytes[i], incremental };
+                if (!incremental) {
+                        if (auto parsed = g_parsed_class_cache.get(get_class_key(clazz_id)); parsed)
+                                job.cf = parsed->cf;
+                        else
+                                job.original = g_class_file_cache.get(clazz_id).value_or(nullptr);
+                }
+
+                if (patched_key.length() > 0)
+                        jobs_by_key[patched_key] = jobs.size();
+                jobs.push_back(std::move(job));
+        }
+
+        size_t max_threads = g_patch_threads;
+        if (max_threads == 0)
+                max_threads = std::thread::hardware_concurrency();
+        parallel_for(jobs.size(), max_threads, [&](size_t i) { run_patch_job(jobs[i]); });
+
+        for (auto &job : jobs) {
+                if (job.parsed)
+                        g_parsed_class_cache.put(get_class_key(job.clazz_id), parsed_class_t { job.cf }, job.original->size());
+
+                if (job.result != JNIHOOK_OK)
+                        continue;
+
+                g_parsed_class_cache.put(get_patched_class_file_key(job.clazz_id), std::move(job.patched), job.class_bytes->size());
+                if (job.patched_key.length() == 0)
+                        continue;
+
+                g_patch_cache.put(job.patched_key, *job.class_bytes, job.class_bytes->size());
+                if (g_disk_cache.is_open())
+                        g_disk_cache.put(job.patched_key, *job.class_bytes);
+        }
+
+        for (auto &job : jobs) {
+                if (job.result != JNIHOOK_OK)
+                        return job.result;
+        }
+
+        for (auto &[i, job] : duplicates)
+                class_bytes[i] = *jobs[job].class_bytes;
+
+        return JNIHOOK_OK;
+}
+
+// Patches up a class with the current hooks (if any)
+// and serializes the result into `class_bytes`
+// NOTE: Must be called with `g_patch_mutex` held
+jnihook_result_t
+PatchClass(const class_id_t &clazz_id, std::vector<u1> &class_bytes)
+{
+        std::vector<std::vector<u1>> patched_bytes;
+
+        if (auto result = PatchClasses({ clazz_id }, patched_bytes); result != JNIHOOK_OK)
+                return result;
+
+        class_bytes = std::move(patched_bytes[0]);
+        return JNIHOOK_OK;
+}
+
+// Patches up a list of classes with the current hooks (if any)
+// and redefines all of them with a single JVMTI call
+jnihook_result_t
+ReapplyClasses(const std::vector<std::pair<jclass, class_id_t>> &classes)
+{
+        std::vector<class_id_t> clazz_ids;
+        std::vector<std::vector<u1>> class_bytes;
+        std::vector<jvmtiClassDefinition> class_definitions(classes.size());
+        jvmtiError err;
+        ScopedTimer timer(g_reapply_classes_ns);
+        std::unique_lock patch_lock(g_patch_mutex);
+
+        for (auto &[_clazz, clazz_id] : classes)
+                clazz_ids.push_back(clazz_id);
+
+        if (auto result = PatchClasses(clazz_ids, class_bytes); result != JNIHOOK_OK)
+                return result;
+
+        for (size_t i = 0; i < classes.size(); ++i) {
+                class_definitions[i].klass = classes[i].first;
+                class_definitions[i].class_byte_count = class_bytes[i].size();
+                class_definitions[i].class_bytes = class_bytes[i].data();
+        }
+
+        // NOTE: `g_patch_mutex` is a leaf lock, and the redefinition
+        //       goes through JNIHook_ClassFileLoadHook
+        patch_lock.unlock();
+
+        if (class_definitions.size() == 0)
+                return JNIHOOK_OK;
+
+        {
+                ScopedTimer redefine_timer(g_redefine_classes_ns);
+                err = g_jnihook->jvmti->RedefineClasses(static_cast<jint>(class_definitions.size()), class_definitions.data());
+        }
+        ++g_redefinitions;
+        g_redefined_classes += static_cast<jlong>(class_definitions.size());
+        LOG("Redefined %zu class(es)\n", class_definitions.size());
+        if (err != JVMTI_ERROR_NONE) {
+                LOG("ERR: JVMTI error in ReapplyClasses: %d\n", err);
+                return JNIHOOK_ERR_JVMTI_OPERATION;
+        }
+
+        return JNIHOOK_OK;
+}
+
+// Patches up a class with the current hooks (if any)
+// and redefines it using JVMTI
+jnihook_result_t
+ReapplyClass(jclass clazz, const class_id_t &clazz_id)
+{
+        return ReapplyClasses({ { clazz, clazz_id } });
+}
+
+// Applies the deferred hooks of a class that is being loaded by handing
+// the patched class back to the JVM, so that no redefinition is needed
+// NOTE: The deferred hooks stay registered, so that the classes with the
+//       same name that are loaded by other class loaders get hooked too
+static void
+ApplyDeferredHooks(jvmtiEnv *jvmti, const class_id_t &clazz_id, const std::vector<deferred_hook_t> &deferred_hooks,
+                   jint class_data_len, const unsigned char *class_data,
+                   jint *new_class_data_len, unsigned char **new_class_data)
+{
+        auto deferred = deferred_hooks;
+        std::vector<deferred_hook_t> applied;
+        std::vector<u1> class_bytes;
+        unsigned char *buf;
+
+        try {
+                std::lock_guard patch_lock(g_patch_mutex);
+
+                cache_class_bytes(clazz_id, class_data_len, class_data);
+
+                // The same class may have been patched with the same hooks already, by
+                // another class loader or by a previous run, in which case it doesn't need
+                // to be parsed at all
+                // NOTE: Every deferred hook was found in the class when the entry was stored,
+                //       otherwise the entry would have been stored with fewer hooks
+                if (auto existing = g_hooks.get(clazz_id); !existing || existing->size() == 0) {
+                        class_hooks_t hooks;
+
+                        for (auto &hook : deferred) {
+                                hooks[get_method_key(hook.method_name, hook.signature)] = hook_info_t {
+                                        method_info_t { hook.method_name, hook.signature, hook.access_flags },
+                                        hook.native_hook_method,
+                                        std::nullopt
+                                };
+                        }
+
+                        if (get_cached_patched_class(clazz_id, hooks, class_bytes)) {
+                                g_hooks.put(clazz_id, std::move(hooks));
+                                applied = deferred;
+                        }
+                }
+
+                if (applied.size() == 0) {
+                        auto cf = get_class_file(clazz_id);
+                        if (!cf)
+                                return;
+
+                        for (auto &hook : deferred) {
+                                auto method = std::find_if(cf->methods.begin(), cf->methods.end(), [&hook](const Method &method) {
+                                        return hook.method_name == method.getName() && hook.signature == method.getDesc();
+                                });
+                                if (method == cf->methods.end()) {
+                                        LOG("WARN: Deferred hook method '%s -> %s' not found in class: %s\n", hook.method_name.c_str(), hook.signature.c_str(), clazz_id.name.c_str());
+                                        continue;
+                                }
+
+                                hook.access_flags = method->accessFlags;
+                                g_hooks.update(clazz_id, [&hook](class_hooks_t &hooks) {
+                                        hooks[get_method_key(hook.method_name, hook.signature)] = hook_info_t {
+                                                method_info_t { hook.method_name, hook.signature, hook.access_flags },
+                                                hook.native_hook_method,
+                                                std::nullopt
+                                        };
+                                });
+                                applied.push_back(hook);
+                        }
+
+                        if (applied.size() == 0 || PatchClass(clazz_id, class_bytes) != JNIHOOK_OK)
+                                goto FAIL;
+                }
+        } catch (...) {
+                LOG("ERR: Failed to patch class with deferred hooks: %s\n", clazz_id.name.c_str());
+                goto FAIL;
+        }
+
+        if (jvmti->Allocate(class_bytes.size(), &buf) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to allocate patched class: %s\n", clazz_id.name.c_str());
+                goto FAIL;
+        }
+
+        memcpy(buf, class_bytes.data(), class_bytes.size());
+        *new_class_data_len = static_cast<jint>(class_bytes.size());
+        *new_class_data = buf;
+
+        // The native methods can only be registered once the class is prepared
+        {
+                std::lock_guard lock(g_loaded_deferred_hooks_mutex);
+                g_loaded_deferred_hooks[clazz_id] = std::move(applied);
+        }
+        LOG("Deferred hooks applied to class: %s (class loader %lld)\n", clazz_id.name.c_str(), static_cast<long long>(clazz_id.loader));
+
+        return;
+
+FAIL:
+        g_hooks.update(clazz_id, [&applied](class_hooks_t &hooks) {
+                for (auto &hook : applied)
+                        hooks.erase(get_method_key(hook.method_name, hook.signature));
+        });
+}
+
+// Looks up a method of a class through JVMTI
+// NOTE: Unlike `GetMethodID`, this doesn't initialize the class
+static jmethodID
+find_class_method(jvmtiEnv *jvmti, jclass clazz, const std::string &name, const std::string &signature)
+{
+        jint method_count;
+        jmethodID *methods;
+        jmethodID found = NULL;
+
+        if (jvmti->GetClassMethods(clazz, &method_count, &methods) != JVMTI_ERROR_NONE)
+                return NULL;
+
+        for (jint i = 0; i < method_count && !found; ++i) {
+                auto method_info = get_method_info(jvmti, methods[i]);
+                if (method_info && method_info->name == name && method_info->signature == signature)
+                        found = methods[i];
+        }
+
+        jvmti->Deallocate(reinterpret_cast<unsigned char *>(methods));
+
+        return found;
+}
+
+// Registers the native methods of the deferred hooks once their class is prepared
+void JNICALL JNIHook_ClassPrepare(jvmtiEnv *jvmti_env,
+                                  JNIEnv *jni_env,
+                                  jthread thread,
+                                  jclass klass)
+{
+        std::vector<deferred_hook_t> deferred;
+
+        // Keeps JNIHook alive until the hook returns
+        auto snapshot = g_snapshot.read();
+        if (!snapshot)
+                return;
+
+        // Class signatures have the format 'Lpackage/ClassName;'
+        auto signature = get_class_signature(jvmti_env, klass);
+        if (signature.length() < 2 || signature[0] != 'L')
+                return;
+
+        auto class_name = signature.substr(1, signature.length() - 2);
+        if (!g_hooked_classes_filter.may_contain(class_name))
+                return;
+
+        auto clazz_id = get_class_id(jni_env, klass);
+        {
+                std::lock_guard lock(g_loaded_deferred_hooks_mutex);
+
+                auto it = g_loaded_deferred_hooks.find(clazz_id);
+                if (it == g_loaded_deferred_hooks.end())
+                        return;
+
+                deferred = std::move(it->second);
+                g_loaded_deferred_hooks.erase(it);
+        }
+
+        for (auto &hook : deferred) {
+                auto hook_type = get_hook_type(hook.method_name, std::nullopt);
+                std::string native_name = hook.method_name;
+                if (hook_type != HookType::Native)
+                        native_name = get_copy_method_name(hook.method_name, class_name);
+
+                JNINativeMethod native_method;
+                native_method.name = const_cast<char *>(native_name.c_str());
+                native_method.signature = const_cast<char *>(hook.signature.c_str());
+                native_method.fnPtr = hook.native_hook_method;
+
+                if (jni_env->RegisterNatives(klass, &native_method, 1) < 0) {
+                        LOG("ERR: Failed to register natives for deferred hook '%s -> %s'\n", hook.method_name.c_str(), hook.signature.c_str());
+                        jni_env->ExceptionClear();
+                        continue;
+                }
+
+                // Index the hooked method so that it can be detached
+                auto method = find_class_method(jvmti_env, klass, hook.method_name, hook.signature);
+                auto method_key = get_method_key(hook.method_name, hook.signature);
+                if (method) {
+                        std::lock_guard lock(g_method_hooks_mutex);
+                        g_method_hooks[method] = hook_location_t { clazz_id, method_key };
+                }
+
+                // The class was not parsed if its patched version was cached (see `ApplyDeferredHooks`),
+                // so the access flags of the method are taken from the prepared class, which only
+                // differ from the original ones in the flag that made the method native
+                jint modifiers;
+                if (method && hook.access_flags == 0 && jvmti_env->GetMethodModifiers(method, &modifiers) == JVMTI_ERROR_NONE) {
+                        if (hook_type == HookType::Native)
+                                modifiers &= ~Method::NATIVE;
+
+                        g_hooks.update(clazz_id, [&method_key, modifiers](class_hooks_t &hooks) {
+                                if (auto it = hooks.find(method_key); it != hooks.end())
+                                        it->second.method_info.access_flags = modifiers;
+                        });
+                }
+
+                if (hook.original_method) {
+                        auto original_name = get_original_method_name(hook_type, hook.method_name, class_name);
+                        *hook.original_method = find_class_method(jvmti_env, klass, original_name, hook.signature);
+                }
+        }
+}
+
+// Stores loaded classes in the class cache, retransforming all
+// the ones that aren't cached yet with a single JVMTI call
+jnihook_result_t
+CacheClasses(JNIEnv *env, const std::vector<jclass> &classes)
+{
+        ScopedTimer timer(g_cache_class_ns);
+        std::vector<jclass> uncached;
+        std::vector<class_id_t> uncached_ids;
+
+        for (auto clazz : classes) {
+                auto clazz_id = get_class_id(env, clazz);
+
+                if (!g_class_file_cache.contains(clazz_id)) {
+                        uncached.push_back(clazz);
+                        uncached_ids.push_back(std::move(clazz_id));
+                }
+        }
+
+        if (uncached.size() == 0)
+                return JNIHOOK_OK;
+
+        // The ClassFileLoadHook caches the classes as they go through it
+        // NOTE: Only these classes are cached, other classes that are loaded or
+        //       redefined by other threads at the same time are not affected
+        {
+                std::lock_guard lock(g_class_caching_mutex);
+                for (auto &clazz_id : uncached_ids)
+                        g_classes_being_cached.insert(clazz_id.name);
+        }
+
+        auto result = g_jnihook->jvmti->RetransformClasses(static_cast<jint>(uncached.size()), uncached.data());
+        LOG("Retransformed %zu class(es) for caching\n", uncached.size());
+
+        {
+                std::lock_guard lock(g_class_caching_mutex);
+                for (auto &clazz_id : uncached_ids)
+                        g_classes_being_cached.erase(clazz_id.name);
+        }
+
+        if (result != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to cache classfile (JVMTI error)\n");
+                return JNIHOOK_ERR_CLASS_FILE_CACHE;
+        }
+
+        for (auto &clazz_id : uncached_ids) {
+                if (!g_class_file_cache.contains(clazz_id)) {
+                        LOG("ERR: Failed to cache classfile: %s\n", clazz_id.name.c_str());
                         return JNIHOOK_ERR_CLASS_FILE_CACHE;
                 }
         }
@@ -652,6 +2040,13 @@ CacheClass(JNIEnv *env, jclass clazz)
         return JNIHOOK_OK;
 }
 
+// Stores a loaded class in the class cache
+jnihook_result_t
+CacheClass(JNIEnv *env, jclass clazz)
+{
+        return CacheClasses(env, { clazz });
+}
+
 // Copy a class and its inner classes
 // (no longer used)
 /*
@@ -786,6 +2181,7 @@ JNIHook_Init(JavaVM *jvm)
 {
         jvmtiEnv *jvmti;
         jvmtiCapabilities capabilities = {};
+        jvmtiCapabilities potential_capabilities = {};
         jvmtiEventCallbacks callbacks = {};
 
         if (jvm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION_1_2) != JNI_OK) {
@@ -799,18 +2195,40 @@ JNIHook_Init(JavaVM *jvm)
         capabilities.can_retransform_any_class = 1;
         capabilities.can_suspend = 1;
 
+        // These can only be added while the JVM starts up (Agent_OnLoad), and let
+        // deferred hooks patch classes that load very early or that are not modifiable
+        if (jvmti->GetPotentialCapabilities(&potential_capabilities) == JVMTI_ERROR_NONE) {
+                capabilities.can_generate_all_class_hook_events = potential_capabilities.can_generate_all_class_hook_events;
+                capabilities.can_generate_early_class_hook_events = potential_capabilities.can_generate_early_class_hook_events;
+        }
+
         if (jvmti->AddCapabilities(&capabilities) != JVMTI_ERROR_NONE) {
                 LOG("ERR: Failed to add capabilities");
                 return JNIHOOK_ERR_ADD_JVMTI_CAPS;
         }
 
         callbacks.ClassFileLoadHook = JNIHook_ClassFileLoadHook;
+        callbacks.ClassPrepare = JNIHook_ClassPrepare;
         if (jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks)) != JVMTI_ERROR_NONE) {
                 LOG("ERR: Failed to setup class file load hook");
                 return JNIHOOK_ERR_SETUP_CLASS_FILE_LOAD_HOOK;
         }
 
+        // The hooks only run once JNIHook and a snapshot are available
         g_jnihook = std::make_unique<jnihook_t>(jnihook_t { jvm, jvmti });
+        {
+                std::lock_guard lock(g_hooks_mutex);
+                publish_snapshot();
+        }
+
+        // The ClassFileLoadHook stays enabled until shutdown, so that classes can be
+        // cached (and patched, for deferred hooks) as they load, without toggling it
+        if (jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to enable class file load hook");
+                g_snapshot.publish(nullptr);
+                g_jnihook = nullptr;
+                return JNIHOOK_ERR_SETUP_CLASS_FILE_LOAD_HOOK;
+        }
 
         // Generate VM type hashmaps
         LOG("Address of gHotspotVMStructs: %p\n", gHotSpotVMStructs);
@@ -862,174 +2280,1336 @@ JNIHook_Init(JavaVM *jvm)
         return JNIHOOK_OK;
 }
 
-JNIHOOK_API jnihook_result_t JNIHOOK_CALL
-_JNIHook_Attach(jmethodID method, void *native_hook_method, jmethodID *original_method, std::optional<size_t> bytecode_offset)
+// Filters out the threads that aren't running code from any of the given classes
+static jnihook_result_t
+filter_targeted_threads(const std::vector<std::pair<jclass, class_id_t>> &classes, std::vector<jthread> &threads)
 {
-        jclass clazz;
-        std::string clazz_name;
-        hook_info_t hook_info;
-        JNIEnv *env;
-        jnihook_result_t result;
+        std::unordered_set<jmethodID> class_methods;
+        jvmtiStackInfo *stack_info;
 
-        HookType hookType = HookType::Native;
+        if (threads.size() == 0)
+                return JNIHOOK_OK;
 
-        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
-                LOG("ERR: Failed to get JNI\n");
-                return JNIHOOK_ERR_GET_JNI;
-        }
+        for (auto &[clazz, _clazz_id] : classes) {
+                jint method_count;
+                jmethodID *methods;
 
-        if (g_jnihook->jvmti->GetMethodDeclaringClass(method, &clazz) != JVMTI_ERROR_NONE) {
-                LOG("ERR: Failed to get declaring class of method\n");
-                return JNIHOOK_ERR_JVMTI_OPERATION;
-        }
+                if (g_jnihook->jvmti->GetClassMethods(clazz, &method_count, &methods) != JVMTI_ERROR_NONE)
+                        return JNIHOOK_ERR_JVMTI_OPERATION;
 
-        clazz_name = get_class_name(env, clazz);
-        if (clazz_name.length() == 0) {
-                LOG("ERR: Failed to get class name\n");
-                return JNIHOOK_ERR_JNI_OPERATION;
+                class_methods.insert(methods, methods + method_count);
+                g_jnihook->jvmti->Deallocate(reinterpret_cast<unsigned char *>(methods));
         }
 
-        auto method_info = get_method_info(g_jnihook->jvmti, method);
-        std::string native_name = method_info->name;
-        if (method_info->name == "<init>") {
-            hookType = HookType::Init;
-            native_name = get_copy_method_name(method_info->name, clazz_name);
-        }else if (method_info->name == "<clinit>") {
-            hookType = HookType::ClInit;
-            native_name = get_copy_method_name(method_info->name, clazz_name);
-        }
-        else if (bytecode_offset) {
-            hookType = HookType::Bytecode;
-            native_name = get_copy_method_name(method_info->name, clazz_name);
+        if (g_jnihook->jvmti->GetThreadListStackTraces(static_cast<jint>(threads.size()), threads.data(),
+                                                       TARGETED_SUSPEND_MAX_FRAMES, &stack_info) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to get thread stack traces\n");
+                return JNIHOOK_ERR_JVMTI_OPERATION;
         }
 
-        if (!method_info) {
-                LOG("ERR: Failed to get method info\n");
-                return JNIHOOK_ERR_JVMTI_OPERATION;
+        std::vector<jthread> targeted;
+        for (size_t i = 0; i < threads.size(); ++i) {
+                auto &info = stack_info[i];
+                for (jint j = 0; j < info.frame_count; ++j) {
+                        if (class_methods.find(info.frame_buffer[j].method) != class_methods.end()) {
+                                targeted.push_back(threads[i]);
+                                break;
+                        }
+                }
         }
 
-        hook_info.method_info = *method_info;
-        hook_info.native_hook_method = native_hook_method;
-        hook_info.bytecode_offset = bytecode_offset;
+        g_jnihook->jvmti->Deallocate(reinterpret_cast<unsigned char *>(stack_info));
+        LOG("Targeted suspension: %zu of %zu threads\n", targeted.size(), threads.size());
+        threads = std::move(targeted);
 
-        // Force caching of the class being hooked
-        result = CacheClass(env, clazz);
-        if (result != JNIHOOK_OK)
-                return result;
+        return JNIHOOK_OK;
+}
 
-        // Suspend other threads while the hook is being set up
+// Suspends the Java threads other than the current one, according to a suspend policy
+// NOTE: Pushes a local frame that is popped by `ResumeOtherThreads`
+static jnihook_result_t
+SuspendOtherThreads(JNIEnv *env, suspended_threads_t &suspended, jnihook_suspend_policy_t policy,
+                    const std::vector<std::pair<jclass, class_id_t>> &classes)
+{
         jthread curthread;
-        jthread *threads;
-        jint thread_count;
+        jnihook_result_t result;
+
+        env->PushLocalFrame(16);
+        suspended.threads = NULL;
+        suspended.thread_count = 0;
+
+        // The class redefinition already happens at a safepoint
+        if (policy == JNIHOOK_SUSPEND_NONE)
+                return JNIHOOK_OK;
+
+        if (g_jnihook->jvmti->GetCurrentThread(&curthread) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to get current thread\n");
+                env->PopLocalFrame(NULL);
+                return JNIHOOK_ERR_JVMTI_OPERATION;
+        }
+
+        if (g_jnihook->jvmti->GetAllThreads(&suspended.thread_count, &suspended.threads) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to get all threads\n");
+                env->PopLocalFrame(NULL);
+                return JNIHOOK_ERR_JVMTI_OPERATION;
+        }
+
+        for (jint i = 0; i < suspended.thread_count; ++i) {
+                if (!env->IsSameObject(suspended.threads[i], curthread))
+                        suspended.suspended.push_back(suspended.threads[i]);
+        }
+
+        if (policy == JNIHOOK_SUSPEND_TARGETED) {
+                if (result = filter_targeted_threads(classes, suspended.suspended); result != JNIHOOK_OK) {
+                        g_jnihook->jvmti->Deallocate(reinterpret_cast<unsigned char *>(suspended.threads));
+                        env->PopLocalFrame(NULL);
+                        return result;
+                }
+        }
+
+        if (suspended.suspended.size() == 0)
+                return JNIHOOK_OK;
+
+        // Suspend all the threads in a single call, and keep track
+        // only of the ones that were actually suspended by us
+        std::vector<jvmtiError> results(suspended.suspended.size());
+        g_jnihook->jvmti->SuspendThreadList(static_cast<jint>(suspended.suspended.size()),
+                                            suspended.suspended.data(), results.data());
+
+        size_t count = 0;
+        for (size_t i = 0; i < results.size(); ++i) {
+                if (results[i] == JVMTI_ERROR_NONE)
+                        suspended.suspended[count++] = suspended.suspended[i];
+        }
+        suspended.suspended.resize(count);
+
+        return JNIHOOK_OK;
+}
+
+// Resumes the threads suspended by `SuspendOtherThreads`
+static void
+ResumeOtherThreads(JNIEnv *env, suspended_threads_t &suspended)
+{
+        if (suspended.suspended.size() > 0) {
+                std::vector<jvmtiError> results(suspended.suspended.size());
+                g_jnihook->jvmti->ResumeThreadList(static_cast<jint>(suspended.suspended.size()),
+                                                   suspended.suspended.data(), results.data());
+        }
+
+        if (suspended.threads)
+                g_jnihook->jvmti->Deallocate(reinterpret_cast<unsigned char *>(suspended.threads));
+        env->PopLocalFrame(NULL);
+}
+
+// Records the latency of an attach operation for the suspend policy it used
+static void
+record_attach_latency(jnihook_suspend_policy_t policy, std::chrono::steady_clock::time_point start)
+{
+        auto elapsed_ns = get_elapsed_ns(start);
+        auto &latency = g_attach_latency[policy];
+
+        latency.count++;
+        latency.total_ns += elapsed_ns;
+        latency.last_ns = elapsed_ns;
+        latency.max_ns = std::max(latency.max_ns, elapsed_ns);
+        LOG("Attach latency (suspend policy %d): %lld ns\n", policy, static_cast<long long>(elapsed_ns));
+}
+
+// Looks up the method that keeps the original (unhooked) behavior of a hooked method
+static jnihook_result_t
+GetOriginalMethod(JNIEnv *env, const prepared_hook_t &hook, jmethodID *original_method)
+{
+        auto &method_info = hook.method_info;
+        jmethodID orig;
+        std::string original_name = get_original_method_name(hook.hook_type, method_info.name, hook.clazz_id.name);
+
+        if ((method_info.access_flags & Method::STATIC) == Method::STATIC) {
+                orig = env->GetStaticMethodID(hook.clazz, original_name.c_str(),
+                                              method_info.signature.c_str());
+        } else {
+                orig = env->GetMethodID(hook.clazz, original_name.c_str(),
+                                        method_info.signature.c_str());
+        }
+
+        if (!orig || env->ExceptionOccurred()) {
+                LOG("ERR: Exception while getting original method '%s -> %s'\n", original_name.c_str(), method_info.signature.c_str());
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                return JNIHOOK_ERR_JAVA_EXCEPTION;
+        }
+
+        *original_method = orig;
+
+        return JNIHOOK_OK;
+}
+
+// Defines a holder class in the loader of the hooked class, or reuses the one that
+// was defined by a previous attach of the same method with the same kind of hook
+// NOTE: Classes can't get new fields through a redefinition, so the state of a
+//       hook lives in the holder class instead of the hooked class.
+//       `build` generates the class, and `resolve` looks up its members.
+static jnihook_result_t
+DefineHolder(JNIEnv *env, const prepared_hook_t &hook, const std::string &kind,
+             const std::function<bool(const std::string &, std::vector<uint8_t> &)> &build,
+             const std::function<bool(JNIEnv *, holder_t &)> &resolve, holder_t **holder)
+{
+        auto &method_info = hook.method_info;
+        auto method_key = get_method_key(method_info.name, method_info.signature);
+        auto key = get_holder_key(hook.clazz_id, method_key, kind);
+        std::vector<uint8_t> class_bytes;
+        jobject loader;
+
+        if (auto it = g_holders.find(key); it != g_holders.end()) {
+                *holder = &it->second;
+                return JNIHOOK_OK;
+        }
+
+        if (g_jnihook->jvmti->GetClassLoader(hook.clazz, &loader) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to get class loader\n");
+                return JNIHOOK_ERR_JVMTI_OPERATION;
+        }
+
+        auto holder_name = get_holder_class_name(hook.clazz_id.name, method_key, kind);
+        if (!build(holder_name, class_bytes)) {
+                LOG("ERR: Failed to build %s holder class for method '%s -> %s'\n", kind.c_str(), method_info.name.c_str(), method_info.signature.c_str());
+                if (loader)
+                        env->DeleteLocalRef(loader);
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
+        }
+
+        // The holder is defined in the same runtime package as the hooked class,
+        // so that it can call its package-private methods
+        jclass clazz = env->DefineClass(holder_name.c_str(), loader,
+                                        reinterpret_cast<const jbyte *>(class_bytes.data()),
+                                        static_cast<jsize>(class_bytes.size()));
+        if (loader)
+                env->DeleteLocalRef(loader);
+
+        if (!clazz || env->ExceptionOccurred()) {
+                LOG("ERR: Exception while defining holder class '%s'\n", holder_name.c_str());
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                return JNIHOOK_ERR_JAVA_EXCEPTION;
+        }
+
+        holder_t entry = { holder_name, clazz };
+        if (!resolve(env, entry) || env->ExceptionOccurred()) {
+                LOG("ERR: Failed to resolve the members of holder class '%s'\n", holder_name.c_str());
+                env->ExceptionClear();
+                env->DeleteLocalRef(clazz);
+                return JNIHOOK_ERR_JAVA_EXCEPTION;
+        }
+
+        LOG("Defined %s holder class: %s\n", kind.c_str(), holder_name.c_str());
+        entry.clazz = reinterpret_cast<jclass>(env->NewGlobalRef(clazz));
+        env->DeleteLocalRef(clazz);
+        *holder = &(g_holders[key] = entry);
+
+        return JNIHOOK_OK;
+}
+
+// Defines the holder class of a guarded hook (see `BuildGuardHolder`)
+static jnihook_result_t
+DefineGuardHolder(JNIEnv *env, const prepared_hook_t &hook, holder_t **holder)
+{
+        auto &method_info = hook.method_info;
+        bool is_static = (method_info.access_flags & Method::STATIC) == Method::STATIC;
+
+        auto build = [&](const std::string &holder_name, std::vector<uint8_t> &class_bytes) {
+                return BuildGuardHolder(holder_name, hook.clazz_id.name, method_info.signature, is_static,
+                                        get_copy_method_name(method_info.name, hook.clazz_id.name),
+                                        get_copy_clone_name(method_info.name, hook.clazz_id.name),
+                                        class_bytes);
+        };
+
+        auto resolve = [](JNIEnv *env, holder_t &holder) {
+                holder.enabled_field = env->GetStaticFieldID(holder.clazz, "enabled", "Z");
+                return holder.enabled_field != nullptr;
+        };
+
+        return DefineHolder(env, hook, "guard", build, resolve, holder);
+}
+
+// Defines the holder class of a sampled hook (see `BuildSampledHolder`)
+static jnihook_result_t
+DefineSampledHolder(JNIEnv *env, const prepared_hook_t &hook, holder_t **holder)
+{
+        auto &method_info = hook.method_info;
+        bool is_static = (method_info.access_flags & Method::STATIC) == Method::STATIC;
+
+        auto build = [&](const std::string &holder_name, std::vector<uint8_t> &class_bytes) {
+                return BuildSampledHolder(holder_name, hook.clazz_id.name, method_info.signature, is_static,
+                                          get_copy_method_name(method_info.name, hook.clazz_id.name),
+                                          get_copy_clone_name(method_info.name, hook.clazz_id.name),
+                                          class_bytes);
+        };
+
+        auto resolve = [](JNIEnv *env, holder_t &holder) {
+                holder.period_field = env->GetStaticFieldID(holder.clazz, "period", "I");
+                holder.countdown_field = env->GetStaticFieldID(holder.clazz, "countdown", "I");
+                return holder.period_field != nullptr && holder.countdown_field != nullptr;
+        };
+
+        return DefineHolder(env, hook, "sampled", build, resolve, holder);
+}
+
+// Defines the holder class of a filtered hook (see `BuildFilterHolder`)
+// NOTE: The holder depends on the parameters and comparisons of the filters, but not
+//       on their values, which are set by `set_filter_values`
+static jnihook_result_t
+DefineFilterHolder(JNIEnv *env, const prepared_hook_t &hook, const method_desc_t &desc, const std::vector<filter_t> &filters,
+                   holder_t **holder)
+{
+        auto &method_info = hook.method_info;
+        bool is_static = (method_info.access_flags & Method::STATIC) == Method::STATIC;
+        std::vector<filter_cond_t> conds;
+        std::string kind = "filter";
+
+        for (auto &filter : filters) {
+                conds.push_back(filter.cond);
+                kind += ":" + std::to_string(filter.cond.param) + "=" + std::to_string(filter.cond.op);
+        }
+
+        auto build = [&](const std::string &holder_name, std::vector<uint8_t> &class_bytes) {
+                return BuildFilterHolder(holder_name, hook.clazz_id.name, method_info.signature, is_static,
+                                         get_copy_method_name(method_info.name, hook.clazz_id.name),
+                                         get_copy_clone_name(method_info.name, hook.clazz_id.name),
+                                         conds, class_bytes);
+        };
+
+        auto resolve = [&](JNIEnv *env, holder_t &holder) {
+                for (size_t i = 0; i < conds.size(); ++i) {
+                        std::string name, field_desc;
+                        jfieldID field = nullptr;
+
+                        if (GetFilterValueField(desc, i, conds[i], name, field_desc)) {
+                                field = env->GetStaticFieldID(holder.clazz, name.c_str(), field_desc.c_str());
+                                if (!field)
+                                        return false;
+                        }
+
+                        holder.value_fields.push_back(field);
+                }
+
+                return true;
+        };
+
+        return DefineHolder(env, hook, kind, build, resolve, holder);
+}
+
+// Checks if the value of a filter is a string
+static inline bool
+is_string_filter(const method_desc_t &desc, const filter_t &filter)
+{
+        return desc.params[filter.cond.param] == HOLDER_STRING_DESC && (filter.cond.op == FILTER_EQ || filter.cond.op == FILTER_NE);
+}
+
+// Releases the strings of the values of the filters of a filtered hook
+static void
+release_filter_values(JNIEnv *env, const method_desc_t &desc, const std::vector<filter_t> &filters, std::vector<jvalue> &values)
+{
+        for (size_t i = 0; i < values.size(); ++i) {
+                if (is_string_filter(desc, filters[i]))
+                        env->DeleteLocalRef(values[i].l);
+        }
+
+        values.clear();
+}
+
+// Gets the values that the filters of a filtered hook compare the arguments to, so that
+// setting them can't fail (see `set_filter_values`)
+// NOTE: The strings are new local references, released by `release_filter_values`
+static bool
+get_filter_values(JNIEnv *env, const method_desc_t &desc, const std::vector<filter_t> &filters, std::vector<jvalue> &values)
+{
+        for (auto &filter : filters) {
+                jvalue value = filter.value;
+
+                if (is_string_filter(desc, filter)) {
+                        value.l = env->NewStringUTF(filter.string->c_str());
+                        if (!value.l) {
+                                env->ExceptionClear();
+                                release_filter_values(env, desc, filters, values);
+                                return false;
+                        }
+                }
+
+                values.push_back(value);
+        }
+
+        return true;
+}
+
+// Sets the values that the filters of a filtered hook compare the arguments to
+static void
+set_filter_values(JNIEnv *env, const holder_t &holder, const method_desc_t &desc, const std::vector<filter_t> &filters,
+                  const std::vector<jvalue> &values)
+{
+        for (size_t i = 0; i < filters.size(); ++i) {
+                auto field = holder.value_fields[i];
+                auto &value = values[i];
+
+                if (!field)
+                        continue;
+
+                switch (desc.params[filters[i].cond.param][0]) {
+                case 'Z':
+                        env->SetStaticIntField(holder.clazz, field, value.z);
+                        break;
+                case 'B':
+                        env->SetStaticIntField(holder.clazz, field, value.b);
+                        break;
+                case 'C':
+                        env->SetStaticIntField(holder.clazz, field, value.c);
+                        break;
+                case 'S':
+                        env->SetStaticIntField(holder.clazz, field, value.s);
+                        break;
+                case 'I':
+                        env->SetStaticIntField(holder.clazz, field, value.i);
+                        break;
+                case 'J':
+                        env->SetStaticLongField(holder.clazz, field, value.j);
+                        break;
+                case 'F':
+                        env->SetStaticFloatField(holder.clazz, field, value.f);
+                        break;
+                case 'D':
+                        env->SetStaticDoubleField(holder.clazz, field, value.d);
+                        break;
+                default:
+                        env->SetStaticObjectField(holder.clazz, field, value.l);
+                        break;
+                }
+        }
+}
+
+// Checks if the filters of a filtered hook can be evaluated on the parameters of its method
+static bool
+can_filter_method(const prepared_hook_t &hook, const std::vector<filter_t> &filters, method_desc_t &desc)
+{
+        if (filters.empty() || !ParseMethodDesc(hook.method_info.signature, desc))
+                return false;
+
+        for (auto &filter : filters) {
+                if (!CanFilterParam(desc, filter.cond))
+                        return false;
+
+                // Strings are compared to a string value
+                if (desc.params[filter.cond.param] == HOLDER_STRING_DESC &&
+                    (filter.cond.op == FILTER_EQ || filter.cond.op == FILTER_NE) && !filter.string)
+                        return false;
+        }
+
+        return true;
+}
+
+// Sets the sampling period of a sampled hook, without redefining the class
+// NOTE: The countdown is shortened, so that a lower period applies right away
+static void
+set_sample_period(JNIEnv *env, const holder_t &holder, jint period)
+{
+        env->SetStaticIntField(holder.clazz, holder.period_field, period);
+        if (env->GetStaticIntField(holder.clazz, holder.countdown_field) > period)
+                env->SetStaticIntField(holder.clazz, holder.countdown_field, period);
+}
+
+// Defines the holder class of a counter hook (see `BuildCounterHolder`)
+static jnihook_result_t
+DefineCounterHolder(JNIEnv *env, const prepared_hook_t &hook, bool striped, holder_t **holder)
+{
+        auto build = [striped](const std::string &holder_name, std::vector<uint8_t> &class_bytes) {
+                return BuildCounterHolder(holder_name, striped, class_bytes);
+        };
+
+        auto resolve = [striped](JNIEnv *env, holder_t &holder) {
+                if (!striped) {
+                        holder.counter_field = env->GetStaticFieldID(holder.clazz, "count", "J");
+                        return holder.counter_field != nullptr;
+                }
+
+                jclass adder_class = env->FindClass(HOLDER_LONG_ADDER_CLASS);
+                if (!adder_class)
+                        return false;
+
+                holder.counter_field = env->GetStaticFieldID(holder.clazz, "adder", HOLDER_LONG_ADDER_DESC);
+                holder.sum_method = env->GetMethodID(adder_class, "sum", "()J");
+                env->DeleteLocalRef(adder_class);
+
+                return holder.counter_field != nullptr && holder.sum_method != nullptr;
+        };
+
+        return DefineHolder(env, hook, striped ? "striped_counter" : "counter", build, resolve, holder);
+}
+
+// Checks if a method can be hooked with a guarded (or sampled, or filtered) hook
+static bool
+can_guard_method(const prepared_hook_t &hook)
+{
+        jboolean is_interface;
+
+        // Constructors and class initializers have their own hooking methods
+        if (hook.method_info.name == "<init>" || hook.method_info.name == "<clinit>")
+                return false;
+
+        // The original code is needed for the disabled path
+        if (hook.method_info.access_flags & (Method::NATIVE | Method::ABSTRACT))
+                return false;
+
+        // The holder calls the hooked class with `invokevirtual`
+        if (g_jnihook->jvmti->IsInterface(hook.clazz, &is_interface) != JVMTI_ERROR_NONE || is_interface)
+                return false;
+
+        return true;
+}
+
+// Sets the state of the holder of a hook to the one of its request: the guard of
+// a guarded hook, the period of a sampled hook or the values of a filtered hook
+static void
+set_holder_state(JNIEnv *env, const prepared_hook_t &hook)
+{
+        auto &holder = *hook.holder;
+
+        switch (hook.hook_type) {
+        case HookType::Guarded:
+                env->SetStaticBooleanField(holder.clazz, holder.enabled_field, *hook.request->guard);
+                break;
+        case HookType::Sampled:
+                set_sample_period(env, holder, *hook.request->sample_period);
+                break;
+        case HookType::Filtered:
+                set_filter_values(env, holder, hook.filter_desc, *hook.request->filters, hook.filter_values);
+                break;
+        default:
+                break;
+        }
+}
+
+// Checks if a method can be hooked with a probe hook
+static bool
+can_probe_method(const prepared_hook_t &hook)
+{
+        jboolean is_interface;
+
+        // `this` can't be passed to the probes before the super constructor is called
+        if (hook.method_info.name == "<init>" || hook.method_info.name == "<clinit>")
+                return false;
+
+        // The probes are injected in the original code
+        if (hook.method_info.access_flags & (Method::NATIVE | Method::ABSTRACT))
+                return false;
+
+        // The probes are called through a `Methodref`, not an `InterfaceMethodref`
+        if (g_jnihook->jvmti->IsInterface(hook.clazz, &is_interface) != JVMTI_ERROR_NONE || is_interface)
+                return false;
+
+        return true;
+}
+
+// Checks if a method can be hooked with a counter hook
+static bool
+can_count_method(const prepared_hook_t &hook)
+{
+        // The counter is incremented by the original code
+        return (hook.method_info.access_flags & (Method::NATIVE | Method::ABSTRACT)) == 0;
+}
+
+// Native methods that a hook registers in the hooked class
+// NOTE: The entries point to the strings of `hook`
+static std::vector<JNINativeMethod>
+get_hook_natives(const prepared_hook_t &hook)
+{
+        std::vector<JNINativeMethod> natives;
+
+        if (hook.hook_type == HookType::Counter)
+                return natives;
+
+        // NOTE: Only the probes are optional
+        if (!hook.request->exit_probe || hook.request->native_hook_method) {
+                natives.push_back(JNINativeMethod {
+                        const_cast<char *>(hook.native_name.c_str()),
+                        const_cast<char *>(hook.native_signature.c_str()),
+                        hook.request->native_hook_method
+                });
+        }
+
+        if (hook.request->exit_probe && *hook.request->exit_probe) {
+                natives.push_back(JNINativeMethod {
+                        const_cast<char *>(hook.exit_name.c_str()),
+                        const_cast<char *>("()V"),
+                        *hook.request->exit_probe
+                });
+        }
+
+        return natives;
+}
+
+// Detaches a batch of hooks, redefining every affected class only once
+jnihook_result_t
+_JNIHook_DetachMany(const jmethodID *methods, size_t n)
+{
+        std::lock_guard lock(g_hooks_mutex);
+        JNIEnv *env;
+        std::vector<std::pair<jclass, class_id_t>> classes;
+        std::unordered_map<class_id_t, size_t, class_id_hash> class_indices;
+        std::vector<std::pair<jmethodID, hook_location_t>> locations;
+        std::vector<std::pair<size_t, hook_info_t>> erased_hooks; // By index in `locations`
+        bool holders_changed = false;
+        jnihook_result_t ret;
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                return JNIHOOK_ERR_GET_JNI;
+        }
+
+        // Resolve every method before removing any hook, so that a failure leaves all of them attached
+        for (size_t i = 0; i < n; ++i) {
+                jclass clazz;
+                hook_location_t location;
+
+                // Methods that aren't in the index aren't hooked
+                {
+                        std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+
+                        auto it = g_method_hooks.find(methods[i]);
+                        if (it == g_method_hooks.end())
+                                continue;
+
+                        location = it->second;
+                }
+
+                if (g_jnihook->jvmti->GetMethodDeclaringClass(methods[i], &clazz) != JVMTI_ERROR_NONE) {
+                        return JNIHOOK_ERR_JVMTI_OPERATION;
+                }
+
+                locations.push_back({ methods[i], location });
+
+                if (class_indices.find(location.clazz_id) == class_indices.end()) {
+                        class_indices[location.clazz_id] = classes.size();
+                        classes.push_back({ clazz, location.clazz_id });
+                }
+        }
+
+        for (size_t i = 0; i < locations.size(); ++i) {
+                auto &[method, location] = locations[i];
+
+                g_hooks.update(location.clazz_id, [&](class_hooks_t &hooks) {
+                        if (auto hook = hooks.find(location.method_key); hook != hooks.end()) {
+                                holders_changed |= hook->second.holder_name.length() > 0;
+                                erased_hooks.push_back({ i, std::move(hook->second) });
+                                hooks.erase(hook);
+                        }
+                });
+
+                std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+                g_method_hooks.erase(method);
+        }
+
+        // The holders of the detached hooks can't be used anymore
+        if (holders_changed)
+                publish_snapshot();
+
+        // Put the hooks back if the classes couldn't be redefined without them
+        if (ret = ReapplyClasses(classes); ret != JNIHOOK_OK) {
+                for (auto &[index, hook] : erased_hooks) {
+                        auto &[method, location] = locations[index];
+
+                        g_hooks.update(location.clazz_id, [&](class_hooks_t &hooks) {
+                                hooks[location.method_key] = hook;
+                        });
+
+                        std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+                        g_method_hooks[method] = location;
+                }
+
+                if (holders_changed)
+                        publish_snapshot();
+        }
+
+        return ret;
+}
+
+// Hook that is registered for a prepared hook
+static hook_info_t
+get_hook_info(const prepared_hook_t &hook)
+{
+        return hook_info_t {
+                hook.method_info,
+                hook.request->native_hook_method,
+                hook.request->bytecode_offset,
+                hook.holder_name,
+                hook.request->exit_probe,
+                hook.request->striped_counter,
+                hook.hook_type == HookType::Sampled,
+                hook.hook_type == HookType::Filtered
+        };
+}
+
+// Attaches a batch of hooks, patching and redefining every affected class
+// only once and suspending the other threads a single time
+// NOTE: A batch that patches every method as its installed hook already does
+//       doesn't redefine any class
+jnihook_result_t
+_JNIHook_AttachMany(const std::vector<attach_request_t> &requests)
+{
+        std::lock_guard lock(g_hooks_mutex);
+        JNIEnv *env;
+        jnihook_result_t ret;
+        std::vector<prepared_hook_t> hooks;
+        std::vector<std::pair<jclass, class_id_t>> classes;
+        std::unordered_map<class_id_t, size_t, class_id_hash> class_indices;
+        suspended_threads_t suspended;
+        jnihook_suspend_policy_t suspend_policy = g_suspend_policy;
+        auto start_time = std::chrono::steady_clock::now();
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                LOG("ERR: Failed to get JNI\n");
+                return JNIHOOK_ERR_GET_JNI;
+        }
+
+        // Resolve the hooked methods and group them by declaring class
+        for (auto &request : requests) {
+                prepared_hook_t hook;
+
+                hook.request = &request;
+
+                if (g_jnihook->jvmti->GetMethodDeclaringClass(request.method, &hook.clazz) != JVMTI_ERROR_NONE) {
+                        LOG("ERR: Failed to get declaring class of method\n");
+                        return JNIHOOK_ERR_JVMTI_OPERATION;
+                }
+
+                hook.clazz_id = get_class_id(env, hook.clazz);
+                if (hook.clazz_id.name.length() == 0) {
+                        LOG("ERR: Failed to get class name\n");
+                        return JNIHOOK_ERR_JNI_OPERATION;
+                }
+
+                auto method_info = get_method_info(g_jnihook->jvmti, request.method);
+                if (!method_info) {
+                        LOG("ERR: Failed to get method info\n");
+                        return JNIHOOK_ERR_JVMTI_OPERATION;
+                }
+
+                hook.method_info = *method_info;
+                hook.hook_type = get_hook_type(method_info->name, request.bytecode_offset, request.guard.has_value(), request.exit_probe.has_value(),
+                                               request.striped_counter.has_value(), request.sample_period.has_value(),
+                                               request.filters.has_value());
+                if (hook.hook_type == HookType::Native)
+                        hook.native_name = method_info->name;
+                else
+                        hook.native_name = get_copy_method_name(method_info->name, hook.clazz_id.name);
+                hook.native_signature = method_info->signature;
+
+                if (hook.hook_type == HookType::Probe) {
+                        if (!can_probe_method(hook) || (!request.native_hook_method && !*request.exit_probe)) {
+                                LOG("ERR: Method '%s -> %s' can't have a probe hook\n", method_info->name.c_str(), method_info->signature.c_str());
+                                return JNIHOOK_ERR_INVALID_ARGUMENT;
+                        }
+
+                        hook.native_signature = get_entry_probe_desc(method_info->signature);
+                        hook.exit_name = get_exit_probe_name(method_info->name, method_info->signature, hook.clazz_id.name);
+                }
+
+                if (hook.hook_type == HookType::Guarded) {
+                        holder_t *holder;
+
+                        if (!can_guard_method(hook)) {
+                                LOG("ERR: Method '%s -> %s' can't have a guarded hook\n", method_info->name.c_str(), method_info->signature.c_str());
+                                return JNIHOOK_ERR_INVALID_ARGUMENT;
+                        }
+
+                        if (ret = DefineGuardHolder(env, hook, &holder); ret != JNIHOOK_OK)
+                                return ret;
+
+                        hook.holder = holder;
+                        hook.holder_name = holder->name;
+                }
+
+                if (hook.hook_type == HookType::Sampled) {
+                        holder_t *holder;
+
+                        if (!can_guard_method(hook) || *request.sample_period < 1) {
+                                LOG("ERR: Method '%s -> %s' can't have a sampled hook\n", method_info->name.c_str(), method_info->signature.c_str());
+                                return JNIHOOK_ERR_INVALID_ARGUMENT;
+                        }
+
+                        if (ret = DefineSampledHolder(env, hook, &holder); ret != JNIHOOK_OK)
+                                return ret;
+
+                        hook.holder = holder;
+                        hook.holder_name = holder->name;
+                }
+
+                if (hook.hook_type == HookType::Filtered) {
+                        holder_t *holder;
+
+                        if (!can_guard_method(hook) || !can_filter_method(hook, *request.filters, hook.filter_desc)) {
+                                LOG("ERR: Method '%s -> %s' can't have a filtered hook\n", method_info->name.c_str(), method_info->signature.c_str());
+                                return JNIHOOK_ERR_INVALID_ARGUMENT;
+                        }
+
+                        if (ret = DefineFilterHolder(env, hook, hook.filter_desc, *request.filters, &holder); ret != JNIHOOK_OK)
+                                return ret;
+
+                        hook.holder = holder;
+                        hook.holder_name = holder->name;
+                }
+
+                if (hook.hook_type == HookType::Counter) {
+                        holder_t *holder;
+
+                        if (!can_count_method(hook)) {
+                                LOG("ERR: Method '%s -> %s' can't have a counter hook\n", method_info->name.c_str(), method_info->signature.c_str());
+                                return JNIHOOK_ERR_INVALID_ARGUMENT;
+                        }
+
+                        // NOTE: The counter keeps its value if the method is hooked again
+                        if (ret = DefineCounterHolder(env, hook, *request.striped_counter, &holder); ret != JNIHOOK_OK)
+                                return ret;
+
+                        hook.holder_name = holder->name;
+                }
+
+                if (class_indices.find(hook.clazz_id) == class_indices.end()) {
+                        class_indices[hook.clazz_id] = classes.size();
+                        classes.push_back({ hook.clazz, hook.clazz_id });
+                }
+
+                hooks.push_back(std::move(hook));
+        }
+
+        // Releases the filter values that are still held by the hooks of this batch
+        auto release_batch_values = [env, &hooks]() {
+                for (auto &hook : hooks) {
+                        if (hook.hook_type == HookType::Filtered)
+                                release_filter_values(env, hook.filter_desc, *hook.request->filters, hook.filter_values);
+                }
+        };
+
+        // Only a batch that changes how a method is patched has to redefine classes, the other
+        // ones only rebind native methods and set the state of the holders of their hooks
+        // NOTE: The state of a holder that is already used by the installed hook of its method
+        //       is only set once the batch has succeeded, so that a failed batch doesn't change
+        //       the installed hook. The other holders aren't used yet, so they are set right away.
+        bool redefine = false;
+        for (auto &hook : hooks) {
+                auto class_hooks = g_hooks.get(hook.clazz_id);
+                std::optional<hook_info_t> installed;
+
+                if (class_hooks) {
+                        auto it = class_hooks->find(get_method_key(hook.method_info.name, hook.method_info.signature));
+                        if (it != class_hooks->end())
+                                installed = it->second;
+                }
+
+                if (!installed || !same_patch(*installed, get_hook_info(hook)))
+                        redefine = true;
+
+                if (!hook.holder)
+                        continue;
+
+                if (hook.hook_type == HookType::Filtered &&
+                    !get_filter_values(env, hook.filter_desc, *hook.request->filters, hook.filter_values)) {
+                        LOG("ERR: Failed to get the filter values of holder class '%s'\n", hook.holder->name.c_str());
+                        release_batch_values();
+                        return JNIHOOK_ERR_JNI_OPERATION;
+                }
+
+                hook.live_holder = installed && installed->holder_name == hook.holder->name;
+                if (!hook.live_holder)
+                        set_holder_state(env, hook);
+        }
+
+        // Force caching of the classes being hooked
+        if (redefine) {
+                std::vector<jclass> class_list;
+                for (auto &[clazz, _clazz_id] : classes)
+                        class_list.push_back(clazz);
+
+                if (ret = CacheClasses(env, class_list); ret != JNIHOOK_OK) {
+                        release_batch_values();
+                        return ret;
+                }
+        }
+
+        // Hooks replaced by this batch, restored if the batch fails
+        std::vector<std::optional<hook_info_t>> replaced_hooks;
+
+        // Original methods of the hooks of this batch, by hook
+        std::vector<jmethodID> originals(hooks.size(), nullptr);
+
+        // Removes the hooks of this batch, restoring the ones they replaced
+        auto remove_batch_hooks = [&hooks, &replaced_hooks]() {
+                for (size_t i = hooks.size(); i-- > 0;) {
+                        auto &hook = hooks[i];
+                        auto key = get_method_key(hook.method_info.name, hook.method_info.signature);
+
+                        if (replaced_hooks[i]) {
+                                g_hooks.update(hook.clazz_id, [&](class_hooks_t &class_hooks) {
+                                        class_hooks[key] = *replaced_hooks[i];
+                                });
+                        } else {
+                                g_hooks.update(hook.clazz_id, [&key](class_hooks_t &class_hooks) {
+                                        class_hooks.erase(key);
+                                });
+
+                                std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+                                g_method_hooks.erase(hook.request->method);
+                        }
+                }
+        };
+
+        // Suspend other threads while the hooks are being set up
+        if (redefine) {
+                if (ret = SuspendOtherThreads(env, suspended, suspend_policy, classes); ret != JNIHOOK_OK) {
+                        release_batch_values();
+                        return ret;
+                }
+        }
+
+        // Apply current hooks
+        for (auto &hook : hooks) {
+                auto key = get_method_key(hook.method_info.name, hook.method_info.signature);
+
+                g_hooked_classes_filter.add(hook.clazz_id.name);
+                g_hooks.update(hook.clazz_id, [&](class_hooks_t &class_hooks) {
+                        auto existing = class_hooks.find(key);
+
+                        if (existing != class_hooks.end())
+                                replaced_hooks.push_back(existing->second);
+                        else
+                                replaced_hooks.push_back(std::nullopt);
+
+                        class_hooks[key] = get_hook_info(hook);
+                });
+
+                std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+                g_method_hooks[hook.request->method] = hook_location_t { hook.clazz_id, key };
+        }
+
+        if (redefine) {
+                if (ret = ReapplyClasses(classes); ret != JNIHOOK_OK) {
+                        LOG("ERR: Failed to reapply classes\n");
+                        remove_batch_hooks();
+                        goto RESUME_THREADS;
+                }
+        }
+
+        // Register native methods for JVM lookup
+        for (auto &hook : hooks) {
+                auto natives = get_hook_natives(hook);
+
+                if (natives.size() > 0 && env->RegisterNatives(hook.clazz, natives.data(), static_cast<jint>(natives.size())) < 0) {
+                        LOG("ERR: Failed to register natives\n");
+                        ret = JNIHOOK_ERR_JNI_OPERATION;
+                        remove_batch_hooks();
+                        if (redefine)
+                                ReapplyClasses(classes); // Attempt to restore classes to previous state
+                        goto RESUME_THREADS;
+                }
+        }
+
+RESUME_THREADS:
+        // Resume other threads, hooks already placed succesfully
+        if (redefine)
+                ResumeOtherThreads(env, suspended);
+
+        // Get original methods, which are only handed out once all of them are found
+        // NOTE: Looking up a method may initialize its class, which must not happen
+        //       while the other threads are suspended
+        if (ret == JNIHOOK_OK) {
+                for (size_t i = 0; i < hooks.size(); ++i) {
+                        if (!hooks[i].request->original_method)
+                                continue;
+
+                        if (ret = GetOriginalMethod(env, hooks[i], &originals[i]); ret != JNIHOOK_OK)
+                                break;
+                }
+
+                // Undo the batch, leaving the hooks it replaced installed
+                if (ret != JNIHOOK_OK) {
+                        remove_batch_hooks();
+                        if (redefine)
+                                ReapplyClasses(classes);
+                }
+        }
+
+        // The batch succeeded, so the installed hooks can switch to their new state
+        if (ret == JNIHOOK_OK) {
+                for (auto &hook : hooks) {
+                        if (hook.holder && hook.live_holder)
+                                set_holder_state(env, hook);
+                }
+        }
+        release_batch_values();
+
+        // NOTE: The suspended threads may hold a read guard of the snapshot,
+        //       so it can only be published once they are resumed
+        if (std::any_of(hooks.begin(), hooks.end(), [](const prepared_hook_t &hook) { return hook.holder_name.length() > 0; }) ||
+            std::any_of(replaced_hooks.begin(), replaced_hooks.end(), [](const std::optional<hook_info_t> &hook) { return hook && hook->holder_name.length() > 0; }))
+                publish_snapshot();
+
+        if (ret != JNIHOOK_OK)
+                return ret;
+
+        for (size_t i = 0; i < hooks.size(); ++i) {
+                if (hooks[i].request->original_method)
+                        *hooks[i].request->original_method = originals[i];
+        }
+
+        record_attach_latency(suspend_policy, start_time);
+
+        return JNIHOOK_OK;
+}
+
+// Attaches a batch of hooks (see `_JNIHook_AttachMany`), turning the exceptions
+// thrown on the way into results
+static jnihook_result_t
+attach_requests(const std::vector<attach_request_t> &requests)
+{
+        try {
+                return _JNIHook_AttachMany(requests);
+        }
+        catch (jnif::Exception ex) {
+                LOG("ERR: JNIF exception thrown -> %s\n", ex.message.c_str());
+                return JNIHOOK_ERR_CLASS_FILE_FORMAT;
+        }
+        catch (...) {
+                LOG("ERR: Unhandled exception thrown\n");
+        }
+        return JNIHOOK_ERR_UNKNOWN;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_Attach(jmethodID method, void *native_hook_method, jmethodID *original_method)
+{
+        return attach_requests({ attach_request_t {
+                .method = method,
+                .native_hook_method = native_hook_method,
+                .original_method = original_method
+        } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_BytecodeAttach(jmethodID method, void* native_hook_method, jmethodID *original_method, size_t offset)
+{
+        return attach_requests({ attach_request_t {
+                .method = method,
+                .native_hook_method = native_hook_method,
+                .original_method = original_method,
+                .bytecode_offset = offset
+        } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachGuarded(jmethodID method, void *native_hook_method, jmethodID *original_method, jboolean enabled)
+{
+        return attach_requests({ attach_request_t {
+                .method = method,
+                .native_hook_method = native_hook_method,
+                .original_method = original_method,
+                .guard = enabled
+        } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachProbe(jmethodID method, void *entry_probe, void *exit_probe)
+{
+        return attach_requests({ attach_request_t { .method = method, .native_hook_method = entry_probe, .exit_probe = exit_probe } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachCounter(jmethodID method, jboolean striped)
+{
+        return attach_requests({ attach_request_t { .method = method, .striped_counter = striped == JNI_TRUE } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachSampled(jmethodID method, void *native_hook_method, jmethodID *original_method, jint period)
+{
+        return attach_requests({ attach_request_t {
+                .method = method,
+                .native_hook_method = native_hook_method,
+                .original_method = original_method,
+                .sample_period = period
+        } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachFiltered(jmethodID method, void *native_hook_method, jmethodID *original_method,
+                       const jnihook_filter_t *filters, size_t n)
+{
+        std::vector<filter_t> request_filters;
+
+        if (!filters || n == 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        // Copy the filters, which are checked against the method once it is resolved
+        for (size_t i = 0; i < n; ++i) {
+                auto &filter = filters[i];
+
+                if (filter.arg < 0 || filter.op < 0 || filter.op >= JNIHOOK_FILTER_OP_COUNT)
+                        return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+                request_filters.push_back(filter_t {
+                        filter_cond_t { static_cast<size_t>(filter.arg), filter.op },
+                        filter.value,
+                        filter.string ? std::optional<std::string>(filter.string) : std::nullopt
+                });
+        }
+
+        return attach_requests({ attach_request_t {
+                .method = method,
+                .native_hook_method = native_hook_method,
+                .original_method = original_method,
+                .filters = std::move(request_filters)
+        } });
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetSamplePeriod(jmethodID method, jint period)
+{
+        JNIEnv *env;
+
+        if (period < 1)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        // Lock-free, like `JNIHook_SetHookEnabled`
+        auto snapshot = g_snapshot.read();
+        if (!snapshot)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                return JNIHOOK_ERR_GET_JNI;
+        }
+
+        auto holder = snapshot->holders.find(method);
+        if (holder == snapshot->holders.end() || !holder->second.period_field)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        set_sample_period(env, holder->second, period);
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetCounters(const jmethodID *methods, size_t n, jlong *counts)
+{
+        JNIEnv *env;
+
+        if ((!methods || !counts) && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        // Lock-free, like `JNIHook_SetHookEnabled`
+        auto snapshot = g_snapshot.read();
+        if (!snapshot)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                return JNIHOOK_ERR_GET_JNI;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                auto holder = snapshot->holders.find(methods[i]);
+                if (holder == snapshot->holders.end() || !holder->second.counter_field) {
+                        counts[i] = -1;
+                        continue;
+                }
+
+                if (!holder->second.sum_method) {
+                        counts[i] = env->GetStaticLongField(holder->second.clazz, holder->second.counter_field);
+                        continue;
+                }
+
+                jobject adder = env->GetStaticObjectField(holder->second.clazz, holder->second.counter_field);
+                counts[i] = adder ? env->CallLongMethod(adder, holder->second.sum_method) : 0;
+                if (adder)
+                        env->DeleteLocalRef(adder);
+        }
+
+        if (env->ExceptionOccurred()) {
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                return JNIHOOK_ERR_JAVA_EXCEPTION;
+        }
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetHookEnabled(jmethodID method, jboolean enabled)
+{
+        JNIEnv *env;
+
+        // Lock-free, since hooks may toggle themselves on hot paths
+        auto snapshot = g_snapshot.read();
+        if (!snapshot)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                return JNIHOOK_ERR_GET_JNI;
+        }
 
-        env->PushLocalFrame(16);
+        auto holder = snapshot->holders.find(method);
+        if (holder == snapshot->holders.end() || !holder->second.enabled_field)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
 
-        if (g_jnihook->jvmti->GetCurrentThread(&curthread) != JVMTI_ERROR_NONE) {
-                LOG("ERR: Failed to get current thread\n");
-                return JNIHOOK_ERR_JVMTI_OPERATION;
+        // No class redefinition needed, the JIT picks up the new value of the guard
+        env->SetStaticBooleanField(holder->second.clazz, holder->second.enabled_field, enabled);
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachMany(const jnihook_attach_t *reqs, size_t n)
+{
+        std::vector<attach_request_t> requests;
+
+        if (!reqs && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        requests.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+                requests.push_back(attach_request_t {
+                        .method = reqs[i].method,
+                        .native_hook_method = reqs[i].native_hook_method,
+                        .original_method = reqs[i].original_method
+                });
         }
 
-        if (g_jnihook->jvmti->GetAllThreads(&thread_count, &threads) != JVMTI_ERROR_NONE) {
-                LOG("ERR: Failed to get all threads\n");
+        return attach_requests(requests);
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachDeferred(const char *class_name, const char *method_name, const char *method_signature,
+                       void *native_hook_method, jmethodID *original_method)
+{
+        if (!class_name || !method_name || !method_signature || !native_hook_method)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        // Accept both 'package.ClassName' and 'package/ClassName'
+        std::string clazz_name = class_name;
+        std::replace(clazz_name.begin(), clazz_name.end(), '.', '/');
+
+        std::lock_guard lock(g_hooks_mutex);
+
+        if (g_jnihook->jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL) != JVMTI_ERROR_NONE) {
+                LOG("ERR: Failed to enable class prepare event\n");
                 return JNIHOOK_ERR_JVMTI_OPERATION;
         }
 
-        // TODO: Only suspend/resume threads that are actually active
-        for (jint i = 0; i < thread_count; ++i) {
-                if (env->IsSameObject(threads[i], curthread))
-                        continue;
+        g_hooked_classes_filter.add(clazz_name);
+        g_deferred_hooks[clazz_name].push_back(deferred_hook_t {
+                method_name,
+                method_signature,
+                native_hook_method,
+                original_method,
+                0
+        });
+        publish_snapshot();
 
-                g_jnihook->jvmti->SuspendThread(threads[i]);
-        }
+        return JNIHOOK_OK;
+}
 
-        // Apply current hooks
-        jnihook_result_t ret = JNIHOOK_ERR_JNI_OPERATION;
-        g_hooks[clazz_name].push_back(hook_info);
-        if (ret = ReapplyClass(clazz, clazz_name); ret != JNIHOOK_OK) {
-                LOG("ERR: Failed to reapply class\n");
-                g_hooks[clazz_name].pop_back();
-                goto RESUME_THREADS;
-        }
-        
-        // Register native method for JVM lookup
-        JNINativeMethod native_method;
-        native_method.name = const_cast<char *>(native_name.c_str());
-        native_method.signature = const_cast<char *>(method_info->signature.c_str());
-        native_method.fnPtr = native_hook_method;
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachDeferred(const char *class_name, const char *method_name, const char *method_signature)
+{
+        if (!class_name || !method_name || !method_signature)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
 
-        if (env->RegisterNatives(clazz, &native_method, 1) < 0) {
-            LOG("ERR: Failed to register natives\n");
-            g_hooks[clazz_name].pop_back();
-            ReapplyClass(clazz, clazz_name); // Attempt to restore class to previous state
-            goto RESUME_THREADS;
-        }
+        std::string clazz_name = class_name;
+        std::replace(clazz_name.begin(), clazz_name.end(), '.', '/');
 
-RESUME_THREADS:
-        // Resume other threads, hook already placed succesfully
-        for (jint i = 0; i < thread_count; ++i) {
-                if (env->IsSameObject(threads[i], curthread))
-                        continue;
+        std::lock_guard lock(g_hooks_mutex);
 
-                g_jnihook->jvmti->ResumeThread(threads[i]);
-        }
+        auto it = g_deferred_hooks.find(clazz_name);
+        if (it == g_deferred_hooks.end())
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
 
-        g_jnihook->jvmti->Deallocate(reinterpret_cast<unsigned char *>(threads));
-        env->PopLocalFrame(NULL);
+        // The classes that are being loaded already got their deferred hooks
+        // (see `g_loaded_deferred_hooks`), so they are left untouched
+        auto &deferred = it->second;
+        auto erased = std::erase_if(deferred, [method_name, method_signature](const deferred_hook_t &hook) {
+                return hook.method_name == method_name && hook.signature == method_signature;
+        });
+        if (erased == 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
 
-        if (ret != JNIHOOK_OK)
-                return ret;
+        if (deferred.size() == 0)
+                g_deferred_hooks.erase(it);
+        publish_snapshot();
 
-        // Get original method
-        ret = JNIHOOK_OK;
-        if (original_method) {
-                jclass orig_class = clazz;
-                jmethodID orig;
-                
-                std::string original_name; 
-                switch (hookType) {
-                case HookType::Init:
-                case HookType::ClInit:
-                    original_name = get_copy_clone_name(method_info->name, clazz_name);
-                    break;
-                case HookType::Bytecode:
-                    original_name = method_info->name;
-                    break;
-                case HookType::Native:
-                    original_name = get_copy_method_name(method_info->name, clazz_name);
-                    break;
-                }
+        return JNIHOOK_OK;
+}
 
-                if ((method_info->access_flags & Method::STATIC) == Method::STATIC) {
-                        orig = env->GetStaticMethodID(orig_class, original_name.c_str(),
-                                                      method_info->signature.c_str());
-                } else {
-                        orig = env->GetMethodID(orig_class, original_name.c_str(),
-                                                method_info->signature.c_str());
-                }
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_PrecacheClasses(const jclass *classes, jint n)
+{
+        JNIEnv *env;
+        std::vector<jclass> modifiable;
 
-                if (!orig || env->ExceptionOccurred()) {
-                        LOG("ERR: Exception while getting original method '%s -> %s'\n", original_name.c_str(), method_info->signature.c_str());
-                        env->ExceptionDescribe();
-                        env->ExceptionClear();
-                        ret = JNIHOOK_ERR_JAVA_EXCEPTION;
-                }
+        if ((!classes && n > 0) || n < 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::lock_guard lock(g_hooks_mutex);
+
+        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
+                return JNIHOOK_ERR_GET_JNI;
+        }
+
+        // A single unmodifiable class would make the whole retransformation fail,
+        // and those classes can't be hooked anyway
+        for (jint i = 0; i < n; ++i) {
+                jboolean is_modifiable;
 
-                *original_method = orig;
+                if (g_jnihook->jvmti->IsModifiableClass(classes[i], &is_modifiable) != JVMTI_ERROR_NONE)
+                        return JNIHOOK_ERR_JVMTI_OPERATION;
+
+                if (is_modifiable)
+                        modifiable.push_back(classes[i]);
         }
 
-        if (ret != JNIHOOK_OK) {
-                JNIHook_Detach(method);
-                return ret;
+        return CacheClasses(env, modifiable);
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPassiveCaching(const char *const *prefixes, size_t n)
+{
+        std::vector<std::string> normalized;
+
+        if (!prefixes && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        for (size_t i = 0; i < n; ++i) {
+                if (!prefixes[i])
+                        return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+                // Accept both 'package.ClassName' and 'package/ClassName'
+                std::string prefix = prefixes[i];
+                std::replace(prefix.begin(), prefix.end(), '.', '/');
+                normalized.push_back(std::move(prefix));
         }
 
+        std::lock_guard lock(g_hooks_mutex);
+        g_passive_caching_prefixes = std::move(normalized);
+        publish_snapshot();
+
         return JNIHOOK_OK;
 }
 
 JNIHOOK_API jnihook_result_t JNIHOOK_CALL
-JNIHook_Attach(jmethodID method, void *native_hook_method, jmethodID *original_method)
+JNIHook_Detach(jmethodID method)
+{
+        return _JNIHook_DetachMany(&method, 1);
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachMany(const jmethodID *methods, size_t n)
 {
+        if (!methods && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
         try {
-                return _JNIHook_Attach(method, native_hook_method, original_method, std::nullopt);
+                return _JNIHook_DetachMany(methods, n);
         }
         catch (jnif::Exception ex) {
                 LOG("ERR: JNIF exception thrown -> %s\n", ex.message.c_str());
@@ -1042,10 +3622,211 @@ JNIHook_Attach(jmethodID method, void *native_hook_method, jmethodID *original_m
 }
 
 JNIHOOK_API jnihook_result_t JNIHOOK_CALL
-JNIHook_BytecodeAttach(jmethodID method, void* native_hook_method, jmethodID *original_method, size_t offset)
+JNIHook_SetSuspendPolicy(jnihook_suspend_policy_t policy)
+{
+        if (policy < 0 || policy >= JNIHOOK_SUSPEND_POLICY_COUNT)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        g_suspend_policy = policy;
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetAttachLatency(jnihook_suspend_policy_t policy, jnihook_latency_t *latency)
+{
+        if (policy < 0 || policy >= JNIHOOK_SUSPEND_POLICY_COUNT || !latency)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::lock_guard lock(g_hooks_mutex);
+        *latency = g_attach_latency[policy];
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPatchCacheBudget(size_t budget)
+{
+        std::lock_guard lock(g_patch_mutex);
+        g_patch_cache.set_budget(budget);
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetClassCacheBudget(size_t budget)
+{
+        std::lock_guard lock(g_patch_mutex);
+        g_parsed_class_cache.set_budget(budget);
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetPatchThreads(size_t threads)
+{
+        g_patch_threads = threads;
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetDiskCacheDirectory(const char *directory)
+{
+        std::vector<u1> stored_uuid;
+
+        std::lock_guard lock(g_hooks_mutex);
+        std::lock_guard patch_lock(g_patch_mutex);
+
+        if (!directory) {
+                g_disk_cache.close();
+                return JNIHOOK_OK;
+        }
+
+        if (!g_disk_cache.open(directory)) {
+                LOG("ERR: Failed to open disk cache directory: %s\n", directory);
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+        }
+
+        // Generate the same names as the previous runs, so that their patched classes
+        // can be reused, unless names were already generated in this run
+        bool valid_uuid = g_disk_cache.get("uuid", stored_uuid) && stored_uuid.size() > 0 &&
+                          std::all_of(stored_uuid.begin(), stored_uuid.end(), [](u1 c) { return isalnum(c) || c == '_'; });
+        std::unique_lock uuid_lock(g_names_uuid_mutex);
+        if (valid_uuid && !g_names_uuid_used) {
+                g_names_uuid = std::string(stored_uuid.begin(), stored_uuid.end());
+        } else if (!valid_uuid) {
+                uuid_lock.unlock();
+                auto &uuid = get_names_uuid();
+                g_disk_cache.put("uuid", std::vector<u1>(uuid.begin(), uuid.end()));
+        }
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetPatchCacheStats(jnihook_patch_cache_stats_t *stats)
+{
+        if (!stats)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::lock_guard lock(g_patch_mutex);
+        stats->hits = g_patch_cache_hits;
+        stats->misses = g_patch_cache_misses;
+        stats->evictions = static_cast<jlong>(g_patch_cache.evictions());
+        stats->entries = static_cast<jlong>(g_patch_cache.count());
+        stats->bytes = static_cast<jlong>(g_patch_cache.weight());
+        stats->budget = static_cast<jlong>(g_patch_cache.get_budget());
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_GetStats(jnihook_stats_t *stats)
+{
+        if (!stats)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::lock_guard lock(g_hooks_mutex);
+        *stats = {};
+
+        g_class_file_cache.for_each([stats](const class_id_t &, const std::shared_ptr<std::vector<u1>> &class_bytes) {
+                ++stats->cached_classes;
+                stats->original_bytes += static_cast<jlong>(class_bytes->size());
+        });
+
+        {
+                std::lock_guard patch_lock(g_patch_mutex);
+
+                g_parsed_class_cache.for_each([stats](const std::string &key, const parsed_class_t &) {
+                        if (key.ends_with("#patched"))
+                                ++stats->patched_classes;
+                        else
+                                ++stats->parsed_classes;
+                });
+                stats->parsed_bytes = static_cast<jlong>(g_parsed_class_cache.weight());
+                stats->patch_cache_bytes = static_cast<jlong>(g_patch_cache.weight());
+                stats->disk_cache_hits = g_disk_cache_hits;
+                stats->disk_cache_misses = g_disk_cache_misses;
+        }
+
+        g_hooks.for_each([stats](const class_id_t &, const class_hooks_t &class_hooks) {
+                for (auto &[_key, hook] : class_hooks) {
+                        switch (get_hook_type(hook)) {
+                        case HookType::Native:
+                                ++stats->native_hooks;
+                                break;
+                        case HookType::Init:
+                                ++stats->init_hooks;
+                                break;
+                        case HookType::ClInit:
+                                ++stats->clinit_hooks;
+                                break;
+                        case HookType::Bytecode:
+                                ++stats->bytecode_hooks;
+                                break;
+                        case HookType::Guarded:
+                                ++stats->guarded_hooks;
+                                break;
+                        case HookType::Probe:
+                                ++stats->probe_hooks;
+                                break;
+                        case HookType::Counter:
+                                ++stats->counter_hooks;
+                                break;
+                        case HookType::Sampled:
+                                ++stats->sampled_hooks;
+                                break;
+                        case HookType::Filtered:
+                                ++stats->filtered_hooks;
+                                break;
+                        }
+                }
+        });
+
+        stats->redefinitions = g_redefinitions;
+        stats->redefined_classes = g_redefined_classes;
+        stats->cache_class_ns = g_cache_class_ns;
+        stats->reapply_classes_ns = g_reapply_classes_ns;
+        stats->redefine_classes_ns = g_redefine_classes_ns;
+
+        return JNIHOOK_OK;
+}
+
+static void
+release_async_handle(jnihook_async_t *handle)
+{
+        if (--handle->refs == 0)
+                delete handle;
+}
+
+// Marks an asynchronous operation as done and runs its completion callback
+static void
+complete_async_job(async_job_t &job, jnihook_result_t result)
+{
+        auto handle = job.handle;
+
+        {
+                std::lock_guard lock(handle->mutex);
+                handle->done = true;
+                handle->result = result;
+        }
+        handle->done_cond.notify_all();
+
+        if (handle->callback)
+                handle->callback(handle, result, handle->user_data);
+
+        release_async_handle(handle);
+}
+
+static jnihook_result_t
+run_async_requests(const std::vector<attach_request_t> &requests, const std::vector<jmethodID> &methods, bool detach)
 {
         try {
-                return _JNIHook_Attach(method, native_hook_method, original_method, offset);
+                if (detach)
+                        return _JNIHook_DetachMany(methods.data(), methods.size());
+
+                return _JNIHook_AttachMany(requests);
         }
         catch (jnif::Exception ex) {
                 LOG("ERR: JNIF exception thrown -> %s\n", ex.message.c_str());
@@ -1057,49 +3838,218 @@ JNIHook_BytecodeAttach(jmethodID method, void* native_hook_method, jmethodID *or
         return JNIHOOK_ERR_UNKNOWN;
 }
 
-JNIHOOK_API jnihook_result_t JNIHOOK_CALL
-JNIHook_Detach(jmethodID method)
+// Runs a batch of asynchronous operations of the same kind as a single
+// operation, so that every affected class is redefined only once
+static void
+run_async_batch(std::vector<async_job_t>::iterator begin, std::vector<async_job_t>::iterator end)
 {
-        JNIEnv *env;
-        jclass clazz;
-        std::string clazz_name;
-        hook_info_t hook_info;
-        jvmtiClassDefinition class_definition;
+        bool detach = begin->detach;
+        std::vector<attach_request_t> requests;
+        std::vector<jmethodID> methods;
 
-        if (g_jnihook->jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8)) {
-                return JNIHOOK_ERR_GET_JNI;
+        if (end - begin == 1) {
+                complete_async_job(*begin, run_async_requests(begin->requests, begin->methods, detach));
+                return;
         }
 
-        if (g_jnihook->jvmti->GetMethodDeclaringClass(method, &clazz) != JVMTI_ERROR_NONE) {
-                return JNIHOOK_ERR_JVMTI_OPERATION;
+        for (auto job = begin; job != end; ++job) {
+                requests.insert(requests.end(), job->requests.begin(), job->requests.end());
+                methods.insert(methods.end(), job->methods.begin(), job->methods.end());
         }
 
-        clazz_name = get_class_name(env, clazz);
-        if (clazz_name.length() == 0) {
-                return JNIHOOK_ERR_JNI_OPERATION;
+        auto result = run_async_requests(requests, methods, detach);
+
+        // A failed attach batch is rolled back completely, so the operations can be
+        // retried one by one to find out which ones failed. Detached hooks aren't
+        // restored, so the result of the whole batch is reported instead.
+        if (result != JNIHOOK_OK && !detach) {
+                LOG("Coalesced attach failed, retrying %zu operations separately\n", static_cast<size_t>(end - begin));
+                for (auto job = begin; job != end; ++job)
+                        complete_async_job(*job, run_async_requests(job->requests, job->methods, detach));
+                return;
         }
 
-        if (g_hooks.find(clazz_name) == g_hooks.end() || g_hooks[clazz_name].size() == 0) {
-                return JNIHOOK_OK;
+        for (auto job = begin; job != end; ++job)
+                complete_async_job(*job, result);
+}
+
+static void
+AsyncWorker(JavaVM *jvm)
+{
+        JNIEnv *env;
+        JavaVMAttachArgs args = { JNI_VERSION_1_8, const_cast<char *>("JNIHook Worker"), NULL };
+        bool attached = jvm->AttachCurrentThreadAsDaemon(reinterpret_cast<void **>(&env), &args) == JNI_OK;
+
+        if (!attached)
+                LOG("ERR: Failed to attach the asynchronous worker to the JVM\n");
+
+        for (;;) {
+                std::vector<async_job_t> jobs;
+
+                {
+                        std::unique_lock lock(g_async_mutex);
+
+                        g_async_cond.wait(lock, [] { return g_async_stop || g_async_queue.size() > 0; });
+                        if (g_async_queue.size() == 0)
+                                break; // Stopped and drained
+
+                        // Give other operations a chance to be queued, so they are coalesced
+                        auto window = std::chrono::microseconds(g_async_coalesce_window_us.load());
+                        if (window.count() > 0)
+                                g_async_cond.wait_for(lock, window, [] { return g_async_stop; });
+
+                        jobs.assign(std::make_move_iterator(g_async_queue.begin()), std::make_move_iterator(g_async_queue.end()));
+                        g_async_queue.clear();
+                }
+
+                LOG("Asynchronous worker running %zu operations\n", jobs.size());
+                if (!attached) {
+                        for (auto &job : jobs)
+                                complete_async_job(job, JNIHOOK_ERR_GET_JNI);
+                        continue;
+                }
+
+                // Coalesce consecutive operations of the same kind, keeping the queue order
+                for (auto begin = jobs.begin(); begin != jobs.end();) {
+                        auto end = begin;
+                        while (end != jobs.end() && end->detach == begin->detach)
+                                ++end;
+
+                        run_async_batch(begin, end);
+                        begin = end;
+                }
         }
 
-        auto method_info = get_method_info(g_jnihook->jvmti, method);
-        if (!method_info) {
-                return JNIHOOK_ERR_JVMTI_OPERATION;
+        if (attached)
+                jvm->DetachCurrentThread();
+}
+
+// Queues an asynchronous operation, starting the worker if needed
+static jnihook_result_t
+QueueAsyncJob(async_job_t job, jnihook_async_callback_t callback, void *user_data, jnihook_async_t **handle)
+{
+        job.handle = new jnihook_async_t;
+        job.handle->callback = callback;
+        job.handle->user_data = user_data;
+        if (handle) {
+                ++job.handle->refs;
+                *handle = job.handle;
         }
 
-        for (size_t i = 0; i < g_hooks[clazz_name].size(); ++i) {
-                auto &hook_info = g_hooks[clazz_name][i];
-                if (hook_info.method_info.name != method_info->name ||
-                    hook_info.method_info.signature != method_info->signature)
-                        continue;
+        {
+                std::lock_guard lock(g_async_mutex);
+
+                if (!g_async_worker.joinable())
+                        g_async_worker = std::thread(AsyncWorker, g_jnihook->jvm);
+
+                g_async_queue.push_back(std::move(job));
+        }
+        g_async_cond.notify_all();
+
+        return JNIHOOK_OK;
+}
+
+// Stops the asynchronous worker after it runs the queued operations
+static void
+StopAsyncWorker()
+{
+        {
+                std::lock_guard lock(g_async_mutex);
+                if (!g_async_worker.joinable())
+                        return;
+
+                g_async_stop = true;
+        }
+        g_async_cond.notify_all();
+
+        g_async_worker.join();
+        g_async_stop = false;
+}
 
-                g_hooks[clazz_name].erase(g_hooks[clazz_name].begin() + i);
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_AttachAsync(const jnihook_attach_t *reqs, size_t n, jnihook_async_callback_t callback,
+                    void *user_data, jnihook_async_t **handle)
+{
+        async_job_t job = { false };
+
+        if (!reqs && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        job.requests.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+                job.requests.push_back(attach_request_t {
+                        .method = reqs[i].method,
+                        .native_hook_method = reqs[i].native_hook_method,
+                        .original_method = reqs[i].original_method
+                });
         }
 
-        return ReapplyClass(clazz, clazz_name);
+        return QueueAsyncJob(std::move(job), callback, user_data, handle);
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_DetachAsync(const jmethodID *methods, size_t n, jnihook_async_callback_t callback,
+                    void *user_data, jnihook_async_t **handle)
+{
+        async_job_t job = { true };
+
+        if (!methods && n > 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        job.methods.assign(methods, methods + n);
+
+        return QueueAsyncJob(std::move(job), callback, user_data, handle);
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_PollAsync(jnihook_async_t *handle, jboolean *done, jnihook_result_t *result)
+{
+        if (!handle || !done)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::lock_guard lock(handle->mutex);
+        *done = handle->done ? JNI_TRUE : JNI_FALSE;
+        if (handle->done && result)
+                *result = handle->result;
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_WaitAsync(jnihook_async_t *handle, jnihook_result_t *result)
+{
+        if (!handle)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        std::unique_lock lock(handle->mutex);
+        handle->done_cond.wait(lock, [handle] { return handle->done; });
+        if (result)
+                *result = handle->result;
+
+        return JNIHOOK_OK;
+}
+
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_ReleaseAsync(jnihook_async_t *handle)
+{
+        if (!handle)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        release_async_handle(handle);
+
+        return JNIHOOK_OK;
 }
 
+JNIHOOK_API jnihook_result_t JNIHOOK_CALL
+JNIHook_SetAsyncCoalesceWindow(jlong window_us)
+{
+        if (window_us < 0)
+                return JNIHOOK_ERR_INVALID_ARGUMENT;
+
+        g_async_coalesce_window_us = window_us;
+
+        return JNIHOOK_OK;
+}
 
 JNIHOOK_API jnihook_result_t JNIHOOK_CALL
 JNIHook_Shutdown()
@@ -1111,26 +4061,64 @@ JNIHook_Shutdown()
                 return JNIHOOK_ERR_GET_JNI;
         }
 
-        for (auto &[key, _value] : g_class_file_cache) {
-                jclass clazz = env->FindClass(key.c_str());
+        // The worker needs `g_hooks_mutex` to finish the queued operations
+        StopAsyncWorker();
 
-                g_hooks[key].clear();
+        std::lock_guard lock(g_hooks_mutex);
 
-                if (!clazz)
-                        continue;
+        // Reapplying the classes with empty hooks will just restore the original ones.
+        // Only the classes that still have hooks need to be restored, and all of them
+        // are redefined at once.
+        // NOTE: The classes are found through their hooked methods, because classes
+        //       of other class loaders can't be looked up by name
+        std::vector<std::pair<jclass, class_id_t>> classes;
+        std::unordered_set<class_id_t, class_id_hash> class_ids;
+        {
+                std::lock_guard method_hooks_lock(g_method_hooks_mutex);
+
+                for (auto &[method, location] : g_method_hooks) {
+                        jclass clazz;
+
+                        if (class_ids.find(location.clazz_id) != class_ids.end() || !g_class_file_cache.contains(location.clazz_id))
+                                continue;
+
+                        if (g_jnihook->jvmti->GetMethodDeclaringClass(method, &clazz) != JVMTI_ERROR_NONE)
+                                continue;
 
-                // Reapplying the class with empty hooks will just restore the original one.
-                ReapplyClass(clazz, key);
+                        class_ids.insert(location.clazz_id);
+                        classes.push_back({ clazz, location.clazz_id });
+                }
         }
 
+        g_hooks.clear();
+        ReapplyClasses(classes);
+
+        g_jnihook->jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+        g_jnihook->jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+
+        // Wait for the hooks that are still running, after which nothing else
+        // reads the state that is cleared below
+        g_snapshot.publish(nullptr);
+
+        g_method_hooks.clear();
+
         g_class_file_cache.clear();
+        g_parsed_class_cache.clear();
+        g_patch_cache.clear();
+        clear_class_ids(env);
+
+        for (auto &[_key, holder] : g_holders)
+                env->DeleteGlobalRef(holder.clazz);
+        g_holders.clear();
+        g_deferred_hooks.clear();
+        g_loaded_deferred_hooks.clear();
+        g_hooked_classes_filter.clear();
 
         // TODO: Fully cleanup defined classes in `g_original_classes` by deleting them from the JVM memory
         //       (if possible without doing crazy hacks)
         // NOTE: The above is no longer needed due to changing the hooking method.
         // g_original_classes.clear();
 
-        g_jnihook->jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
         g_jnihook->jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
         jvmtiCapabilities caps{};
@@ -1139,6 +4127,8 @@ JNIHook_Shutdown()
 		caps.can_retransform_classes = 1;
         caps.can_retransform_any_class = 1;
 		caps.can_suspend = 1;
+        caps.can_generate_all_class_hook_events = 1;
+        caps.can_generate_early_class_hook_events = 1;
 		jvmtiError err = g_jnihook->jvmti->RelinquishCapabilities(&caps);
 
         g_jnihook = nullptr;
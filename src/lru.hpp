@@ -0,0 +1,124 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LRU_HPP_
+#define _LRU_HPP_
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// Least recently used cache, bounded by the sum of the weights of its values
+template <typename K, typename V>
+class LruCache {
+private:
+        typedef struct {
+                K key;
+                V value;
+                size_t weight;
+        } entry_t;
+
+        std::list<entry_t> entries; // Most recently used first
+        std::unordered_map<K, typename std::list<entry_t>::iterator> index;
+        size_t budget;
+        size_t total_weight = 0;
+        size_t eviction_count = 0;
+
+        void evict(size_t max_weight)
+        {
+                while (total_weight > max_weight && entries.size() > 0) {
+                        auto &entry = entries.back();
+                        total_weight -= entry.weight;
+                        index.erase(entry.key);
+                        entries.pop_back();
+                        ++eviction_count;
+                }
+        }
+
+public:
+        LruCache(size_t budget) : budget(budget) {}
+
+        // Returns the cached value (if any) and marks it as the most recently used
+        V *get(const K &key)
+        {
+                auto it = index.find(key);
+                if (it == index.end())
+                        return nullptr;
+
+                entries.splice(entries.begin(), entries, it->second);
+                return &it->second->value;
+        }
+
+        // Caches a value, evicting the least recently used ones if the budget is exceeded
+        // NOTE: Values heavier than the whole budget are not cached
+        void put(const K &key, V value, size_t weight)
+        {
+                erase(key);
+                if (weight > budget)
+                        return;
+
+                evict(budget - weight);
+                entries.push_front(entry_t { key, std::move(value), weight });
+                index[key] = entries.begin();
+                total_weight += weight;
+        }
+
+        void erase(const K &key)
+        {
+                auto it = index.find(key);
+                if (it == index.end())
+                        return;
+
+                total_weight -= it->second->weight;
+                entries.erase(it->second);
+                index.erase(it);
+        }
+
+        void clear()
+        {
+                entries.clear();
+                index.clear();
+                total_weight = 0;
+        }
+
+        void set_budget(size_t new_budget)
+        {
+                budget = new_budget;
+                evict(budget);
+        }
+
+        // Calls `fn(key, value)` for every cached value, without changing their order
+        template <typename F>
+        void for_each(F fn) const
+        {
+                for (auto &entry : entries)
+                        fn(entry.key, entry.value);
+        }
+
+        inline size_t get_budget() { return budget; }
+        inline size_t weight() { return total_weight; }
+        inline size_t count() { return entries.size(); }
+        inline size_t evictions() { return eviction_count; }
+};
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PARALLEL_HPP_
+#define _PARALLEL_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Runs `fn(i)` for every `i` in [0, count), spread over up to `max_threads`
+// threads, one of which is the calling thread
+// NOTE: `fn` must not throw. If a worker thread can't be started, its share
+//       of the work is picked up by the other threads.
+template <typename Fn>
+void parallel_for(size_t count, size_t max_threads, Fn fn)
+{
+        std::atomic<size_t> next = 0;
+        std::vector<std::thread> workers;
+
+        auto work = [&]() {
+                for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+                        fn(i);
+        };
+
+        auto threads = std::min(count, std::max<size_t>(max_threads, 1));
+        for (size_t i = 1; i < threads; ++i) {
+                try {
+                        workers.emplace_back(work);
+                } catch (const std::system_error &) {
+                        break;
+                }
+        }
+
+        work();
+        for (auto &worker : workers)
+                worker.join();
+}
+
+#endif
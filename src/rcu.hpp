@@ -0,0 +1,129 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RCU_HPP_
+#define _RCU_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+// Pointer to an immutable object that readers use without locks, while writers
+// publish new versions of it (read-copy-update)
+// NOTE: Readers register in the counters of the current epoch. Publishing a new
+//       version flips the epoch and waits for the readers of the previous one,
+//       so an old version is only deleted once no reader can be using it.
+//       Writers must be serialized by the caller, and must not hold a read guard.
+template <typename T, size_t Stripes = 16>
+class RcuPtr {
+        static_assert(Stripes > 0, "At least one stripe is needed");
+private:
+        // Each stripe has its own cache line, so that the readers of different
+        // threads don't contend on the same counter
+        struct alignas(64) counter_t {
+                std::atomic<size_t> count = 0;
+        };
+
+        std::atomic<const T *> current = nullptr;
+        std::atomic<size_t> epoch = 0;
+        counter_t readers[2][Stripes];
+
+        static size_t get_stripe()
+        {
+                static std::atomic<size_t> next_stripe = 0;
+                thread_local size_t stripe = next_stripe++ % Stripes;
+
+                return stripe;
+        }
+
+        void wait_for_readers(size_t parity)
+        {
+                for (auto &counter : readers[parity]) {
+                        while (counter.count.load() > 0)
+                                std::this_thread::yield();
+                }
+        }
+
+public:
+        // Keeps the version that was current when it was created alive
+        class ReadGuard {
+                friend class RcuPtr;
+        private:
+                std::atomic<size_t> *counter;
+                const T *ptr;
+
+                ReadGuard(std::atomic<size_t> *counter, const T *ptr) : counter(counter), ptr(ptr) {}
+        public:
+                ReadGuard(const ReadGuard &) = delete;
+                ReadGuard &operator=(const ReadGuard &) = delete;
+                ~ReadGuard() { counter->fetch_sub(1, std::memory_order_release); }
+
+                const T *get() const { return ptr; }
+                const T *operator->() const { return ptr; }
+                explicit operator bool() const { return ptr != nullptr; }
+        };
+
+        RcuPtr() = default;
+        RcuPtr(const RcuPtr &) = delete;
+        RcuPtr &operator=(const RcuPtr &) = delete;
+        ~RcuPtr() { delete current.load(); }
+
+        ReadGuard read()
+        {
+                auto stripe = get_stripe();
+
+                for (;;) {
+                        auto current_epoch = epoch.load();
+                        auto &counter = readers[current_epoch & 1][stripe].count;
+
+                        counter.fetch_add(1);
+                        // If the epoch flipped meanwhile, the writer may not wait for this reader
+                        if (epoch.load() == current_epoch)
+                                return ReadGuard(&counter, current.load());
+                        counter.fetch_sub(1, std::memory_order_release);
+                }
+        }
+
+        // Publishes a new version (which may be null), and deletes the previous
+        // one once all of its readers are done
+        void publish(std::unique_ptr<const T> next)
+        {
+                auto previous = current.exchange(next.release());
+
+                synchronize();
+                delete previous;
+        }
+
+        // Waits for the readers that may still use a previous version
+        void synchronize()
+        {
+                auto current_epoch = epoch.load();
+
+                // Readers of the epoch before that registered late, after the last flip
+                wait_for_readers((current_epoch + 1) & 1);
+                epoch.store(current_epoch + 1);
+                wait_for_readers(current_epoch & 1);
+        }
+};
+
+#endif
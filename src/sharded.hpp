@@ -0,0 +1,164 @@
+/*
+ *  -----------------------------------
+ * |         JNIHook - by rdbo         |
+ * |      Java VM Hooking Library      |
+ *  -----------------------------------
+ */
+
+/*
+ * Copyright (C) 2026    Rdbo
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHARDED_HPP_
+#define _SHARDED_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+// Hash map split into shards that are locked independently, so that threads
+// working on different keys don't contend on a single lock
+// NOTE: Values are only accessed while their shard is locked, either through
+//       copies or through callbacks, so no reference to a value can leak.
+template <typename K, typename V, typename Hash = std::hash<K>, size_t Shards = 64>
+class ShardedMap {
+        static_assert(Shards > 0, "At least one shard is needed");
+private:
+        typedef struct {
+                mutable std::mutex mutex;
+                std::unordered_map<K, V, Hash> map;
+        } shard_t;
+
+        shard_t shards[Shards];
+
+        // The hash is scrambled first, otherwise the keys of a shard would
+        // all fall in the same buckets of the map of the shard
+        shard_t &get_shard(const K &key)
+        {
+                return shards[((static_cast<uint64_t>(Hash {}(key)) * 11400714819323198485ULL) >> 32) % Shards];
+        }
+
+        const shard_t &get_shard(const K &key) const
+        {
+                return const_cast<ShardedMap *>(this)->get_shard(key);
+        }
+
+public:
+        // Calls `fn` with the value of `key` while its shard is locked
+        // Returns false if the key is not in the map
+        template <typename F>
+        bool find(const K &key, F &&fn) const
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                auto it = shard.map.find(key);
+                if (it == shard.map.end())
+                        return false;
+
+                fn(it->second);
+                return true;
+        }
+
+        bool contains(const K &key) const
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                return shard.map.find(key) != shard.map.end();
+        }
+
+        std::optional<V> get(const K &key) const
+        {
+                std::optional<V> value;
+
+                find(key, [&value](const V &found) { value = found; });
+                return value;
+        }
+
+        // Inserts a value, unless the key is already in the map
+        // Returns false if the key was already in the map
+        bool insert(const K &key, V value)
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                return shard.map.try_emplace(key, std::move(value)).second;
+        }
+
+        void put(const K &key, V value)
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                shard.map.insert_or_assign(key, std::move(value));
+        }
+
+        // Calls `fn` with the value of `key` while its shard is locked,
+        // inserting a default value first if the key is not in the map
+        template <typename F>
+        auto update(const K &key, F &&fn)
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                return fn(shard.map[key]);
+        }
+
+        bool erase(const K &key)
+        {
+                auto &shard = get_shard(key);
+                std::lock_guard lock(shard.mutex);
+
+                return shard.map.erase(key) > 0;
+        }
+
+        // Calls `fn` with every key and value, locking one shard at a time
+        template <typename F>
+        void for_each(F &&fn) const
+        {
+                for (auto &shard : shards) {
+                        std::lock_guard lock(shard.mutex);
+
+                        for (auto &[key, value] : shard.map)
+                                fn(key, value);
+                }
+        }
+
+        size_t size() const
+        {
+                size_t count = 0;
+
+                for (auto &shard : shards) {
+                        std::lock_guard lock(shard.mutex);
+                        count += shard.map.size();
+                }
+
+                return count;
+        }
+
+        void clear()
+        {
+                for (auto &shard : shards) {
+                        std::lock_guard lock(shard.mutex);
+                        shard.map.clear();
+                }
+        }
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include <jnihook.h>
+#include <chrono>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static constexpr int ATTACH_ITERATIONS = 50;
+static constexpr int PLUGIN_LOADERS = 64;
+static constexpr int STRESS_ATTACH_THREADS = 4;
+static constexpr int STRESS_LOADER_THREADS = 4;
+static constexpr auto STRESS_DURATION = std::chrono::seconds(2);
+static constexpr auto CALL_RATE_DURATION = std::chrono::milliseconds(500);
+static constexpr jint SAMPLE_PERIOD = 1000;
+static constexpr jint FILTER_VALUE = 42;
+
+static jmethodID orig_BenchTarget_work = NULL;
+static std::atomic<long> probe_calls = 0;
+
+JNIEXPORT jint JNICALL hk_BenchTarget_work(JNIEnv *jni, jclass clazz, jint value)
+{
+        return value * 31 + 7;
+}
+
+JNIEXPORT jint JNICALL hk_BenchTarget_work_original(JNIEnv *jni, jclass clazz, jint value)
+{
+        return jni->CallStaticIntMethod(clazz, orig_BenchTarget_work, value);
+}
+
+JNIEXPORT void JNICALL probe_BenchTarget_work_entry(JNIEnv *jni, jclass clazz, jint value)
+{
+        probe_calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+JNIEXPORT void JNICALL probe_BenchTarget_work_exit(JNIEnv *jni, jclass clazz)
+{
+}
+
+JNIEXPORT jint JNICALL hk_BenchPlugin_work(JNIEnv *jni, jclass clazz, jint value)
+{
+        return value + 2;
+}
+
+static void
+bench_suspend_policy(JNIEnv *env, jclass bench_class, jnihook_suspend_policy_t policy, const char *policy_name)
+{
+        jclass target_class = env->FindClass("dummy/BenchTarget");
+        jmethodID work_mid = env->GetStaticMethodID(target_class, "work", "(I)I");
+        jmethodID start_recording = env->GetStaticMethodID(bench_class, "startRecording", "()V");
+        jmethodID stop_recording = env->GetStaticMethodID(bench_class, "stopRecording", "()[J");
+        jnihook_latency_t latency;
+        jlong pauses[4];
+
+        JNIHook_SetSuspendPolicy(policy);
+
+        env->CallStaticVoidMethod(bench_class, start_recording);
+        for (int i = 0; i < ATTACH_ITERATIONS; ++i) {
+                jmethodID orig;
+
+                if (auto result = JNIHook_Attach(work_mid, reinterpret_cast<void *>(hk_BenchTarget_work), &orig); result != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to attach hook: " << result << std::endl;
+                        break;
+                }
+
+                JNIHook_Detach(work_mid);
+        }
+        auto pauses_array = reinterpret_cast<jlongArray>(env->CallStaticObjectMethod(bench_class, stop_recording));
+        env->GetLongArrayRegion(pauses_array, 0, 4, pauses);
+
+        JNIHook_GetAttachLatency(policy, &latency);
+
+        std::cout << "[*] Suspend policy: " << policy_name << std::endl;
+        std::cout << "    attach latency: avg " << (latency.count ? latency.total_ns / latency.count : 0) / 1000
+                  << " us, max " << latency.max_ns / 1000 << " us (" << latency.count << " attaches)" << std::endl;
+        std::cout << "    application pauses: " << pauses[0] << ", p50 " << pauses[1] / 1000
+                  << " us, p99 " << pauses[2] / 1000 << " us, max " << pauses[3] / 1000 << " us" << std::endl;
+}
+
+// Counts the copies of BenchPlugin that call the hook
+static int
+count_hooked_plugins(JNIEnv *env, jobjectArray plugins, std::vector<jmethodID> &work_mids)
+{
+        int hooked = 0;
+
+        work_mids.clear();
+        for (int i = 0; i < PLUGIN_LOADERS; ++i) {
+                auto plugin = reinterpret_cast<jclass>(env->GetObjectArrayElement(plugins, i));
+                jmethodID work_mid = env->GetStaticMethodID(plugin, "work", "(I)I");
+
+                if (env->CallStaticIntMethod(plugin, work_mid, 0) == 2)
+                        ++hooked;
+
+                work_mids.push_back(work_mid);
+                env->DeleteLocalRef(plugin);
+        }
+
+        return hooked;
+}
+
+static void
+bench_class_loaders(JNIEnv *env, jclass bench_class)
+{
+        jmethodID load_plugins = env->GetStaticMethodID(bench_class, "loadPlugins", "(I)[Ljava/lang/Class;");
+        std::vector<jmethodID> work_mids;
+        std::vector<jnihook_attach_t> reqs;
+        jnihook_stats_t stats;
+
+        // Every copy of the class is patched while it is being loaded
+        if (auto result = JNIHook_AttachDeferred("dummy/BenchPlugin", "work", "(I)I", reinterpret_cast<void *>(hk_BenchPlugin_work), NULL); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to attach deferred hook: " << result << std::endl;
+                return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto plugins = reinterpret_cast<jobjectArray>(env->CallStaticObjectMethod(bench_class, load_plugins, PLUGIN_LOADERS));
+        auto load_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (!plugins || env->ExceptionCheck()) {
+                std::cerr << "[!] Failed to load plugins" << std::endl;
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                return;
+        }
+
+        int deferred_hooked = count_hooked_plugins(env, plugins, work_mids);
+
+        // Then the hooks of every copy are replaced at once, which redefines all of them
+        JNIHook_DetachMany(work_mids.data(), work_mids.size());
+        for (auto work_mid : work_mids)
+                reqs.push_back(jnihook_attach_t { work_mid, reinterpret_cast<void *>(hk_BenchPlugin_work), NULL });
+
+        start = std::chrono::steady_clock::now();
+        auto result = JNIHook_AttachMany(reqs.data(), reqs.size());
+        auto attach_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to attach hooks: " << result << std::endl;
+                return;
+        }
+
+        int attached_hooked = count_hooked_plugins(env, plugins, work_mids);
+        JNIHook_GetStats(&stats);
+        JNIHook_DetachMany(work_mids.data(), work_mids.size());
+
+        std::cout << "[*] Class loaders: " << PLUGIN_LOADERS << " copies of dummy.BenchPlugin" << std::endl;
+        std::cout << "    deferred hooks: " << load_ns / PLUGIN_LOADERS / 1000 << " us per class load, "
+                  << deferred_hooked << " of " << PLUGIN_LOADERS << " copies hooked" << std::endl;
+        std::cout << "    batched attach: " << attach_ns / 1000 << " us, "
+                  << attached_hooked << " of " << PLUGIN_LOADERS << " copies hooked" << std::endl;
+        std::cout << "    cached classes: " << stats.cached_classes << ", patched classes: " << stats.patched_classes
+                  << ", patch cache: " << stats.patch_cache_bytes << " bytes" << std::endl;
+
+        env->DeleteLocalRef(plugins);
+}
+
+// Calls per second of BenchTarget.work, made by the application threads
+static jlong
+measure_call_rate(JNIEnv *env, jclass bench_class)
+{
+        jmethodID count_calls = env->GetStaticMethodID(bench_class, "countCalls", "()J");
+
+        jlong before = env->CallStaticLongMethod(bench_class, count_calls);
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(CALL_RATE_DURATION);
+        jlong after = env->CallStaticLongMethod(bench_class, count_calls);
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        return static_cast<jlong>((after - before) * 1000000000.0 / elapsed_ns);
+}
+
+// Compares the cost of the hooks that observe a hot method, which keep its behavior
+static void
+bench_hook_overhead(JNIEnv *env, jclass bench_class)
+{
+        jclass target_class = env->FindClass("dummy/BenchTarget");
+        jmethodID work_mid = env->GetStaticMethodID(target_class, "work", "(I)I");
+
+        std::cout << "[*] Hook overhead (calls per second of dummy.BenchTarget.work)" << std::endl;
+        std::cout << "    unhooked: " << measure_call_rate(env, bench_class) << std::endl;
+
+        if (JNIHook_Attach(work_mid, reinterpret_cast<void *>(hk_BenchTarget_work_original), &orig_BenchTarget_work) == JNIHOOK_OK) {
+                std::cout << "    native hook calling the original: " << measure_call_rate(env, bench_class) << std::endl;
+                JNIHook_Detach(work_mid);
+        }
+
+        if (JNIHook_AttachProbe(work_mid, reinterpret_cast<void *>(probe_BenchTarget_work_entry),
+                                reinterpret_cast<void *>(probe_BenchTarget_work_exit)) == JNIHOOK_OK) {
+                std::cout << "    entry and exit probes: " << measure_call_rate(env, bench_class) << std::endl;
+                JNIHook_Detach(work_mid);
+        }
+
+        if (JNIHook_AttachSampled(work_mid, reinterpret_cast<void *>(hk_BenchTarget_work_original), &orig_BenchTarget_work,
+                                  SAMPLE_PERIOD) == JNIHOOK_OK) {
+                std::cout << "    sampled hook (1 in " << SAMPLE_PERIOD << "): " << measure_call_rate(env, bench_class) << std::endl;
+                JNIHook_Detach(work_mid);
+        }
+
+        jnihook_filter_t filter = {};
+        filter.arg = 0;
+        filter.op = JNIHOOK_FILTER_EQ;
+        filter.value.i = FILTER_VALUE;
+        if (JNIHook_AttachFiltered(work_mid, reinterpret_cast<void *>(hk_BenchTarget_work_original), &orig_BenchTarget_work,
+                                   &filter, 1) == JNIHOOK_OK) {
+                std::cout << "    filtered hook (value == " << FILTER_VALUE << "): " << measure_call_rate(env, bench_class) << std::endl;
+                JNIHook_Detach(work_mid);
+        }
+
+        for (auto striped : { JNI_FALSE, JNI_TRUE }) {
+                jlong count;
+
+                if (JNIHook_AttachCounter(work_mid, striped) != JNIHOOK_OK)
+                        continue;
+
+                auto rate = measure_call_rate(env, bench_class);
+                JNIHook_GetCounters(&work_mid, 1, &count);
+                std::cout << "    " << (striped ? "striped counter: " : "plain counter: ") << rate
+                          << " (" << count << " calls counted)" << std::endl;
+                JNIHook_Detach(work_mid);
+        }
+}
+
+// Attaches and detaches hooks from several threads while other threads keep
+// loading classes with deferred hooks
+// NOTE: Must run after `bench_class_loaders`, which registers the deferred hook
+static void
+bench_concurrency(JNIEnv *env, jclass bench_class)
+{
+        jmethodID start_loading = env->GetStaticMethodID(bench_class, "startLoading", "(I)V");
+        jmethodID stop_loading = env->GetStaticMethodID(bench_class, "stopLoading", "()[J");
+        jclass target_class = env->FindClass("dummy/BenchTarget");
+        jmethodID work_mid = env->GetStaticMethodID(target_class, "work", "(I)I");
+        std::atomic<bool> running = true;
+        std::atomic<long> attaches = 0;
+        std::atomic<long> failures = 0;
+        std::vector<std::thread> threads;
+        JavaVM *jvm;
+        jlong loaded[2];
+
+        env->GetJavaVM(&jvm);
+        JNIHook_SetSuspendPolicy(JNIHOOK_SUSPEND_ALL);
+
+        env->CallStaticVoidMethod(bench_class, start_loading, STRESS_LOADER_THREADS);
+        if (env->ExceptionCheck()) {
+                std::cerr << "[!] Failed to start the loader threads" << std::endl;
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                return;
+        }
+
+        for (int i = 0; i < STRESS_ATTACH_THREADS; ++i) {
+                threads.emplace_back([&]() {
+                        JNIEnv *thread_env;
+
+                        if (jvm->AttachCurrentThread(reinterpret_cast<void **>(&thread_env), NULL) != JNI_OK) {
+                                ++failures;
+                                return;
+                        }
+
+                        while (running) {
+                                jmethodID orig;
+
+                                if (JNIHook_Attach(work_mid, reinterpret_cast<void *>(hk_BenchTarget_work), &orig) != JNIHOOK_OK) {
+                                        ++failures;
+                                        continue;
+                                }
+
+                                JNIHook_Detach(work_mid);
+                                ++attaches;
+                        }
+
+                        jvm->DetachCurrentThread();
+                });
+        }
+
+        std::this_thread::sleep_for(STRESS_DURATION);
+        running = false;
+        for (auto &thread : threads)
+                thread.join();
+
+        auto loaded_array = reinterpret_cast<jlongArray>(env->CallStaticObjectMethod(bench_class, stop_loading));
+        env->GetLongArrayRegion(loaded_array, 0, 2, loaded);
+
+        std::cout << "[*] Concurrency: " << STRESS_ATTACH_THREADS << " attaching threads, "
+                  << STRESS_LOADER_THREADS << " class loading threads" << std::endl;
+        std::cout << "    attaches: " << attaches << ", failures: " << failures << std::endl;
+        std::cout << "    loaded classes: " << loaded[0] << ", unhooked copies: " << loaded[1] << std::endl;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_dummy_Bench_runBenchmarks(JNIEnv *env, jclass bench_class)
+{
+        JavaVM *jvm;
+
+        env->GetJavaVM(&jvm);
+        if (auto result = JNIHook_Init(jvm); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to initialize JNIHook: " << result << std::endl;
+                return;
+        }
+
+        bench_suspend_policy(env, bench_class, JNIHOOK_SUSPEND_ALL, "all threads");
+        bench_suspend_policy(env, bench_class, JNIHOOK_SUSPEND_TARGETED, "targeted threads");
+        bench_suspend_policy(env, bench_class, JNIHOOK_SUSPEND_NONE, "none");
+        bench_class_loaders(env, bench_class);
+        bench_concurrency(env, bench_class);
+        bench_hook_overhead(env, bench_class);
+
+        JNIHook_Shutdown();
+}
@@ -0,0 +1,225 @@
+package dummy;
+
+import java.io.InputStream;
+import java.lang.reflect.Method;
+import java.util.Arrays;
+import java.util.concurrent.atomic.AtomicLong;
+
+class BenchTarget {
+    public static int work(int value) {
+        return value * 31 + 7;
+    }
+}
+
+// Loaded through many class loaders, like a plugin loaded once per tenant
+class BenchPlugin {
+    public static int work(int value) {
+        return value + 1;
+    }
+}
+
+public class Bench {
+    private static final int APP_THREADS = 8;
+    private static final long PAUSE_THRESHOLD_NS = 20_000; // Gaps above this are considered pauses
+    private static final int MAX_PAUSES = 1 << 16;
+
+    private static volatile boolean running = true;
+    private static volatile boolean recording = false;
+    private static final Worker[] workers = new Worker[APP_THREADS];
+    private static final AtomicLong linkErrors = new AtomicLong();
+
+    // Application thread that measures the gaps between its own iterations
+    static class Worker extends Thread {
+        final long[] pauses = new long[MAX_PAUSES];
+        volatile int pauseCount = 0;
+        long calls = 0;
+        int sink = 0;
+
+        public void run() {
+            long last = System.nanoTime();
+            while (running) {
+                try {
+                    sink = BenchTarget.work(sink);
+                    ++calls;
+                } catch (UnsatisfiedLinkError e) {
+                    // Without thread suspension, the hooked method may be called
+                    // before its native method is registered
+                    linkErrors.incrementAndGet();
+                }
+                long now = System.nanoTime();
+                long gap = now - last;
+                if (recording && gap >= PAUSE_THRESHOLD_NS && pauseCount < MAX_PAUSES)
+                    pauses[pauseCount++] = gap;
+                last = now;
+            }
+        }
+    }
+
+    // Defines its own copy of BenchPlugin, and delegates the other classes to its parent
+    static class PluginLoader extends ClassLoader {
+        private final byte[] pluginBytes;
+
+        PluginLoader(byte[] pluginBytes) {
+            super(Bench.class.getClassLoader());
+            this.pluginBytes = pluginBytes;
+        }
+
+        protected Class<?> loadClass(String name, boolean resolve) throws ClassNotFoundException {
+            if (!name.equals("dummy.BenchPlugin"))
+                return super.loadClass(name, resolve);
+
+            synchronized (getClassLoadingLock(name)) {
+                Class<?> loaded = findLoadedClass(name);
+                if (loaded == null)
+                    loaded = defineClass(name, pluginBytes, 0, pluginBytes.length);
+                return loaded;
+            }
+        }
+    }
+
+    // Keeps loading new copies of BenchPlugin and checks that each of them is hooked
+    static class LoaderThread extends Thread {
+        final byte[] pluginBytes;
+        volatile boolean loading = true;
+        long loaded = 0;
+        long unhooked = 0;
+
+        LoaderThread(byte[] pluginBytes) {
+            this.pluginBytes = pluginBytes;
+        }
+
+        public void run() {
+            try {
+                while (loading) {
+                    Class<?> plugin = Class.forName("dummy.BenchPlugin", true, new PluginLoader(pluginBytes));
+                    Method work = plugin.getDeclaredMethod("work", int.class);
+                    work.setAccessible(true);
+                    if ((int)work.invoke(null, 0) != 2)
+                        ++unhooked;
+                    ++loaded;
+                }
+            } catch (Exception e) {
+                e.printStackTrace();
+            }
+        }
+    }
+
+    private static LoaderThread[] loaderThreads;
+
+    private static native void runBenchmarks();
+
+    // Called from the benchmark library
+    // Loads and initializes a copy of BenchPlugin through each of `count` new class loaders
+    static Class<?>[] loadPlugins(int count) throws Exception {
+        byte[] pluginBytes;
+        try (InputStream in = Bench.class.getResourceAsStream("BenchPlugin.class")) {
+            pluginBytes = in.readAllBytes();
+        }
+
+        Class<?>[] plugins = new Class<?>[count];
+        for (int i = 0; i < count; ++i)
+            plugins[i] = Class.forName("dummy.BenchPlugin", true, new PluginLoader(pluginBytes));
+        return plugins;
+    }
+
+    // Called from the benchmark library
+    static void startLoading(int threads) throws Exception {
+        byte[] pluginBytes;
+        try (InputStream in = Bench.class.getResourceAsStream("BenchPlugin.class")) {
+            pluginBytes = in.readAllBytes();
+        }
+
+        loaderThreads = new LoaderThread[threads];
+        for (int i = 0; i < threads; ++i) {
+            loaderThreads[i] = new LoaderThread(pluginBytes);
+            loaderThreads[i].start();
+        }
+    }
+
+    // Called from the benchmark library
+    // Returns { loaded classes, loaded classes that weren't hooked }
+    static long[] stopLoading() throws InterruptedException {
+        long loaded = 0;
+        long unhooked = 0;
+
+        for (LoaderThread thread : loaderThreads)
+            thread.loading = false;
+        for (LoaderThread thread : loaderThreads) {
+            thread.join();
+            loaded += thread.loaded;
+            unhooked += thread.unhooked;
+        }
+        loaderThreads = null;
+
+        return new long[] { loaded, unhooked };
+    }
+
+    // Called from the benchmark library
+    // Returns the number of calls made by the application threads so far
+    static long countCalls() {
+        long calls = 0;
+        for (Worker worker : workers)
+            calls += worker.calls;
+        return calls;
+    }
+
+    // Called from the benchmark library
+    static void startRecording() {
+        for (Worker worker : workers)
+            worker.pauseCount = 0;
+        recording = true;
+    }
+
+    // Called from the benchmark library
+    // Returns { pause count, p50 pause, p99 pause, max pause } in nanoseconds
+    static long[] stopRecording() throws InterruptedException {
+        recording = false;
+        Thread.sleep(10); // Let the workers settle
+
+        long errors = linkErrors.getAndSet(0);
+        if (errors > 0)
+            System.out.println("[*] Calls that failed to link: " + errors);
+
+        int total = 0;
+        for (Worker worker : workers)
+            total += worker.pauseCount;
+
+        long[] pauses = new long[total];
+        int offset = 0;
+        for (Worker worker : workers) {
+            System.arraycopy(worker.pauses, 0, pauses, offset, worker.pauseCount);
+            offset += worker.pauseCount;
+        }
+        Arrays.sort(pauses);
+
+        if (total == 0)
+            return new long[] { 0, 0, 0, 0 };
+
+        return new long[] {
+            total,
+            pauses[(int)(total * 0.50)],
+            pauses[Math.min(total - 1, (int)(total * 0.99))],
+            pauses[total - 1]
+        };
+    }
+
+    public static void main(String[] args) throws InterruptedException {
+        if (args.length == 0) {
+            System.out.println("Missing library path!");
+            System.exit(-1);
+        }
+
+        for (int i = 0; i < APP_THREADS; ++i) {
+            workers[i] = new Worker();
+            workers[i].start();
+        }
+
+        Thread.sleep(1000); // Warm up
+        System.load(args[0]);
+        runBenchmarks();
+
+        running = false;
+        for (Worker worker : workers)
+            worker.join();
+    }
+}
@@ -66,8 +66,56 @@ class Target extends TargetSuperclass {
         System.out.println("returning target");
         return new Target();
     }
+    public static int guardedTest(int value) {
+        System.out.println("guardedTest called with: " + value);
+        return value + 1;
+    }
+    public static int counterTest(int value) {
+        return value + 1;
+    }
+    public static int sampledTest(int value) {
+        return value + 1;
+    }
+    public static int filteredTest(String name, int value) {
+        return value + 1;
+    }
+    public int probeTest(int value) {
+        if (value < 0)
+            throw new IllegalArgumentException("negative value: " + value);
+        System.out.println("probeTest called with: " + value);
+        return value * 3;
+    }
+    public static int attachManyTest1(int value) {
+        return value + 1;
+    }
+    public static int attachManyTest2(int value) {
+        return value + 1;
+    }
+    public static int detachManyTest1(int value) {
+        return value + 1;
+    }
+    public static int detachManyTest2(int value) {
+        return value + 1;
+    }
+    public static int asyncTest(int value) {
+        return value + 1;
+    }
+}
+
+// Only loaded after the hooks are placed (used for deferred hooks)
+class Lazy {
+    public static int compute(int value) {
+        System.out.println("Lazy::compute called with: " + value);
+        return value * 2;
+    }
 }
 
+// Only loaded after the hooks are placed (hooked by the manifest agent, if it is attached)
+class Manifest {
+    public static int compute(int value) {
+        return value * 2;
+    }
+}
 
 public class Dummy {
     public static void main(String[] args) throws IOException {
@@ -93,6 +141,31 @@ public class Dummy {
         Target.midFunctionTest2();
         Target.midFunctionTest2();
         Target.midFunctionTest3();
+        System.out.println("Guarded result: " + Target.guardedTest(1));
+        System.out.println("Guarded result: " + Target.guardedTest(1));
+        System.out.println("Probe result: " + obj.probeTest(2));
+        try {
+            obj.probeTest(-1);
+        } catch (IllegalArgumentException e) {
+            System.out.println("Probe exception: " + e.getMessage());
+        }
+        for (int i = 0; i < 3; ++i)
+            Target.counterTest(i);
+        for (int i = 0; i < 6; ++i)
+            System.out.println("Sampled result: " + Target.sampledTest(i));
+        System.out.println("Filtered result: " + Target.filteredTest("tenant", 20));
+        System.out.println("Filtered result: " + Target.filteredTest("tenant", 5));
+        System.out.println("Filtered result: " + Target.filteredTest("other", 20));
+        System.out.println("Filtered result: " + Target.filteredTest(null, 20));
+        System.out.println("AttachMany result: " + Target.attachManyTest1(1) + " (expected 20)");
+        System.out.println("AttachMany result: " + Target.attachManyTest2(1) + " (expected 40)");
+        System.out.println("DetachMany result: " + Target.detachManyTest1(1) + " (expected 100)");
+        System.out.println("DetachMany result: " + Target.detachManyTest2(1) + " (expected 2)");
+        System.out.println("DetachMany result: " + Target.detachManyTest1(1) + " (expected 2)");
+        System.out.println("Async result: " + Target.asyncTest(1) + " (expected 200)");
+        System.out.println("Async result: " + Target.asyncTest(1) + " (expected 2)");
+        System.out.println("Lazy result: " + Lazy.compute(21));
+        System.out.println("Manifest result: " + Manifest.compute(21) + " (expected 4200 with the manifest agent)");
         System.out.println("Done!");
     }
 }
@@ -1,6 +1,11 @@
 #include <jnihook.h>
 #include <jnihook.hpp>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
 
 jclass Target_class;
 jmethodID Target_sayHello_mid;
@@ -10,11 +15,28 @@ jmethodID Target_Constructor_mid;
 jmethodID Target_midFunctionTest_mid;
 jmethodID Target_midFunctionTest2_mid;
 jmethodID Target_midFunctionTest3_mid;
+jmethodID Target_guardedTest_mid;
+jmethodID Target_probeTest_mid;
+jmethodID Target_counterTest_mid;
+jmethodID Target_sampledTest_mid;
+jmethodID Target_filteredTest_mid;
+jmethodID Target_attachManyTest1_mid;
+jmethodID Target_attachManyTest2_mid;
+jmethodID Target_detachManyTest1_mid;
+jmethodID Target_detachManyTest2_mid;
+jmethodID Target_asyncTest_mid;
 jmethodID orig_Target_sayAnotherThing = NULL;
 jmethodID orig_Target_Constructor = NULL;
 jmethodID orig_Target_midFunctionTest = NULL;
 jmethodID orig_Target_midFunctionTest2 = NULL;
 jmethodID orig_Target_midFunctionTest3 = NULL;
+jmethodID orig_Target_attachManyTest1 = NULL;
+jmethodID orig_Target_attachManyTest2 = NULL;
+jmethodID orig_Target_guardedTest = NULL;
+jmethodID orig_Target_sampledTest = NULL;
+jmethodID orig_Target_filteredTest = NULL;
+jmethodID orig_Target_asyncTest = NULL;
+jmethodID orig_Lazy_compute = NULL;
 
 JNIEXPORT void JNICALL hk_Target_sayHello(JNIEnv *jni, jobject obj)
 {
@@ -67,6 +89,115 @@ JNIEXPORT void JNICALL hk_Target_midFunctionTest3(JNIEnv* jni, jobject object)
 {
     std::cout << "\033[9m\033[48;2;100;0;88m\033[38;2;50;170;255mSpace Monkey 2\033[0m" << std::endl;
 }
+JNIEXPORT jint JNICALL hk_Target_guardedTest(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::guardedTest (guarded) HOOK CALLED!" << std::endl;
+        std::cout << "Calling original method..." << std::endl;
+        jint result = jni->CallStaticIntMethod(clazz, orig_Target_guardedTest, value) * 100;
+
+        std::cout << "Disabling the guarded hook, next call should do its default behavior." << std::endl;
+        JNIHook_SetHookEnabled(Target_guardedTest_mid, JNI_FALSE);
+
+        return result;
+}
+
+JNIEXPORT jint JNICALL hk_Target_sampledTest(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::sampledTest (sampled) HOOK CALLED! Value: " << value << std::endl;
+        return jni->CallStaticIntMethod(clazz, orig_Target_sampledTest, value) * 100;
+}
+
+JNIEXPORT jint JNICALL hk_Target_filteredTest(JNIEnv *jni, jclass clazz, jstring name, jint value)
+{
+        std::cout << "Target::filteredTest (filtered) HOOK CALLED! Value: " << value << std::endl;
+        return jni->CallStaticIntMethod(clazz, orig_Target_filteredTest, name, value) * 100;
+}
+
+JNIEXPORT jint JNICALL hk_Target_attachManyTest1(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::attachManyTest1 HOOK CALLED!" << std::endl;
+        return jni->CallStaticIntMethod(clazz, orig_Target_attachManyTest1, value) * 10;
+}
+
+JNIEXPORT jint JNICALL hk_Target_attachManyTest2(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::attachManyTest2 HOOK CALLED!" << std::endl;
+        return jni->CallStaticIntMethod(clazz, orig_Target_attachManyTest2, value) * 20;
+}
+
+JNIEXPORT jint JNICALL hk_Target_detachManyTest1(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::detachManyTest1 HOOK CALLED! Detaching both hooks at once..." << std::endl;
+
+        jmethodID methods[] = { Target_detachManyTest1_mid, Target_detachManyTest2_mid };
+        JNIHook_DetachMany(methods, sizeof(methods) / sizeof(methods[0]));
+        std::cout << "Hooks Target::detachManyTest1 and Target::detachManyTest2 detached." << std::endl;
+
+        return value * 100;
+}
+
+JNIEXPORT jint JNICALL hk_Target_detachManyTest2(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::detachManyTest2 HOOK CALLED! (should never happen)" << std::endl;
+        return value * 100;
+}
+
+void JNIHOOK_CALL async_Target_asyncTest_detached(jnihook_async_t *handle, jnihook_result_t result, void *user_data)
+{
+        std::cout << "Target::asyncTest detach completed on the worker thread: " << result << std::endl;
+}
+
+JNIEXPORT jint JNICALL hk_Target_asyncTest(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Target::asyncTest (async) HOOK CALLED!" << std::endl;
+        jint result = jni->CallStaticIntMethod(clazz, orig_Target_asyncTest, value) * 100;
+
+        std::cout << "Detaching the hook in the background..." << std::endl;
+        jnihook_async_t *handle;
+        if (JNIHook_DetachAsync(&Target_asyncTest_mid, 1, async_Target_asyncTest_detached, nullptr, &handle) == JNIHOOK_OK) {
+                jnihook_result_t detach_result;
+
+                JNIHook_WaitAsync(handle, &detach_result);
+                JNIHook_ReleaseAsync(handle);
+                std::cout << "Hook Target::asyncTest detached: " << detach_result << " (expected 0)" << std::endl;
+        }
+
+        return result;
+}
+
+JNIEXPORT void JNICALL probe_Target_probeTest_entry(JNIEnv *jni, jobject obj, jint value)
+{
+        std::cout << "Target::probeTest ENTRY PROBE CALLED! Value: " << value << std::endl;
+}
+
+JNIEXPORT void JNICALL probe_Target_probeTest_exit(JNIEnv *jni, jobject obj)
+{
+        std::cout << "Target::probeTest EXIT PROBE CALLED!" << std::endl;
+}
+
+// Looked up by the manifest agent, so the names must not be mangled
+extern "C" {
+JNIEXPORT jmethodID orig_Manifest_compute = NULL;
+}
+
+extern "C" JNIEXPORT jint JNICALL hk_Manifest_compute(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Manifest::compute (manifest) HOOK CALLED!" << std::endl;
+        return jni->CallStaticIntMethod(clazz, orig_Manifest_compute, value) * 100;
+}
+
+JNIEXPORT jint JNICALL hk_Lazy_compute(JNIEnv *jni, jclass clazz, jint value)
+{
+        std::cout << "Lazy::compute (deferred) HOOK CALLED!" << std::endl;
+        std::cout << "Original value: " << value << std::endl;
+
+        jlong count;
+        JNIHook_GetCounters(&Target_counterTest_mid, 1, &count);
+        std::cout << "Target::counterTest was called " << count << " times (expected 3)" << std::endl;
+
+        return jni->CallStaticIntMethod(clazz, orig_Lazy_compute, value + 1);
+}
+
 void
 start()
 {
@@ -111,6 +242,36 @@ start()
         Target_midFunctionTest3_mid = env->GetStaticMethodID(Target_class, "midFunctionTest3", "()Ldummy/Target;");
         std::cout << "[*] Target::midFunctionTest2: " << Target_midFunctionTest3_mid << std::endl;
 
+        Target_guardedTest_mid = env->GetStaticMethodID(Target_class, "guardedTest", "(I)I");
+        std::cout << "[*] Target::guardedTest: " << Target_guardedTest_mid << std::endl;
+
+        Target_probeTest_mid = env->GetMethodID(Target_class, "probeTest", "(I)I");
+        std::cout << "[*] Target::probeTest: " << Target_probeTest_mid << std::endl;
+
+        Target_attachManyTest1_mid = env->GetStaticMethodID(Target_class, "attachManyTest1", "(I)I");
+        std::cout << "[*] Target::attachManyTest1: " << Target_attachManyTest1_mid << std::endl;
+
+        Target_attachManyTest2_mid = env->GetStaticMethodID(Target_class, "attachManyTest2", "(I)I");
+        std::cout << "[*] Target::attachManyTest2: " << Target_attachManyTest2_mid << std::endl;
+
+        Target_detachManyTest1_mid = env->GetStaticMethodID(Target_class, "detachManyTest1", "(I)I");
+        std::cout << "[*] Target::detachManyTest1: " << Target_detachManyTest1_mid << std::endl;
+
+        Target_detachManyTest2_mid = env->GetStaticMethodID(Target_class, "detachManyTest2", "(I)I");
+        std::cout << "[*] Target::detachManyTest2: " << Target_detachManyTest2_mid << std::endl;
+
+        Target_asyncTest_mid = env->GetStaticMethodID(Target_class, "asyncTest", "(I)I");
+        std::cout << "[*] Target::asyncTest: " << Target_asyncTest_mid << std::endl;
+
+        Target_counterTest_mid = env->GetStaticMethodID(Target_class, "counterTest", "(I)I");
+        std::cout << "[*] Target::counterTest: " << Target_counterTest_mid << std::endl;
+
+        Target_sampledTest_mid = env->GetStaticMethodID(Target_class, "sampledTest", "(I)I");
+        std::cout << "[*] Target::sampledTest: " << Target_sampledTest_mid << std::endl;
+
+        Target_filteredTest_mid = env->GetStaticMethodID(Target_class, "filteredTest", "(Ljava/lang/String;I)I");
+        std::cout << "[*] Target::filteredTest: " << Target_filteredTest_mid << std::endl;
+
         // Place hooks
         JNIHook_Init(jvm); // Test to make sure init and shutdown are clean
         JNIHook_Shutdown();
@@ -120,6 +281,19 @@ start()
         }
         std::cout << "[*] JNIHook initialized successfully" << std::endl;
 
+        // Later runs reuse the classes patched by this one
+        if (auto result = JNIHook_SetDiskCacheDirectory("jnihook_cache"); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to set disk cache directory: " << result << std::endl;
+                goto DETACH;
+        }
+        std::cout << "[*] Disk cache enabled successfully" << std::endl;
+
+        if (auto result = JNIHook_PrecacheClasses(&Target_class, 1); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to precache classes: " << result << std::endl;
+                goto DETACH;
+        }
+        std::cout << "[*] dummy.Target precached successfully" << std::endl;
+
         if (auto result = JNIHook_Attach(Target_Constructor_mid, reinterpret_cast<void*>(hk_Target_Constructor), &orig_Target_Constructor); result != JNIHOOK_OK) {
             std::cerr << "[!] Failed to attach hook: " << result << std::endl;
             goto DETACH;
@@ -138,6 +312,19 @@ start()
         }
         std::cout << "[*] Target::sayAnotherThing hooked successfully!" << std::endl;
 
+        {
+                jnihook_attach_t reqs[] = {
+                        { Target_attachManyTest1_mid, reinterpret_cast<void *>(hk_Target_attachManyTest1), &orig_Target_attachManyTest1 },
+                        { Target_attachManyTest2_mid, reinterpret_cast<void *>(hk_Target_attachManyTest2), &orig_Target_attachManyTest2 },
+                };
+
+                if (auto result = JNIHook_AttachMany(reqs, sizeof(reqs) / sizeof(reqs[0])); result != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to attach hooks: " << result << std::endl;
+                        goto DETACH;
+                }
+        }
+        std::cout << "[*] Target::attachManyTest1 and Target::attachManyTest2 hooked successfully!" << std::endl;
+
         if (auto result = JNIHook_BytecodeAttach(Target_midFunctionTest_mid, reinterpret_cast<void*>(hk_Target_midFunctionTest), &orig_Target_midFunctionTest, 5); result != JNIHOOK_OK) {
             std::cerr << "[!] Failed to attach hook: " << result << std::endl;
             goto DETACH;
@@ -156,7 +343,158 @@ start()
         }
         std::cout << "[*] Target::midFunctionTest3 hooked successfully!" << std::endl;
 
+        if (auto result = JNIHook_AttachGuarded(Target_guardedTest_mid, reinterpret_cast<void*>(hk_Target_guardedTest), &orig_Target_guardedTest, JNI_TRUE); result != JNIHOOK_OK) {
+            std::cerr << "[!] Failed to attach guarded hook: " << result << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Target::guardedTest hooked successfully!" << std::endl;
+
+        if (auto result = JNIHook_AttachProbe(Target_probeTest_mid, reinterpret_cast<void*>(probe_Target_probeTest_entry), reinterpret_cast<void*>(probe_Target_probeTest_exit)); result != JNIHOOK_OK) {
+            std::cerr << "[!] Failed to attach probe hook: " << result << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Target::probeTest probed successfully!" << std::endl;
+
+        {
+                jnihook_attach_t reqs[] = {
+                        { Target_detachManyTest1_mid, reinterpret_cast<void *>(hk_Target_detachManyTest1), nullptr },
+                        { Target_detachManyTest2_mid, reinterpret_cast<void *>(hk_Target_detachManyTest2), nullptr },
+                };
+
+                if (auto result = JNIHook_AttachMany(reqs, sizeof(reqs) / sizeof(reqs[0])); result != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to attach hooks: " << result << std::endl;
+                        goto DETACH;
+                }
+        }
+        std::cout << "[*] Target::detachManyTest1 and Target::detachManyTest2 hooked successfully!" << std::endl;
+
+        {
+                jnihook_attach_t req = { Target_asyncTest_mid, reinterpret_cast<void *>(hk_Target_asyncTest), &orig_Target_asyncTest };
+                jnihook_async_t *handle;
+                jnihook_result_t result;
+
+                if (JNIHook_AttachAsync(&req, 1, nullptr, nullptr, &handle) != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to queue async hook" << std::endl;
+                        goto DETACH;
+                }
+
+                JNIHook_WaitAsync(handle, &result);
+                JNIHook_ReleaseAsync(handle);
+                if (result != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to attach async hook: " << result << std::endl;
+                        goto DETACH;
+                }
+        }
+        std::cout << "[*] Target::asyncTest hooked successfully in the background!" << std::endl;
+
+        // A failed redefinition must leave the class (and the other threads) running as before
+        // NOTE: The native method of a mid-function hook has the descriptor of the hooked method,
+        //       so calling it first thing in a method with parameters fails the verification
+        if (auto result = JNIHook_BytecodeAttach(Target_counterTest_mid, reinterpret_cast<void*>(hk_Target_midFunctionTest), nullptr, 0); result == JNIHOOK_OK) {
+            std::cerr << "[!] Bytecode hook with unverifiable bytecode was attached" << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Target::counterTest failed to be redefined as expected" << std::endl;
+
+        if (auto result = JNIHook_AttachCounter(Target_counterTest_mid, JNI_FALSE); result != JNIHOOK_OK) {
+            std::cerr << "[!] Failed to attach counter hook: " << result << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Target::counterTest counted successfully!" << std::endl;
+
+        if (auto result = JNIHook_AttachSampled(Target_sampledTest_mid, reinterpret_cast<void*>(hk_Target_sampledTest), &orig_Target_sampledTest, 3); result != JNIHOOK_OK) {
+            std::cerr << "[!] Failed to attach sampled hook: " << result << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Target::sampledTest hooked successfully (1 in 3 calls)!" << std::endl;
+
+        {
+            // Only hook the calls with name == "tenant" && value > 10
+            jnihook_filter_t filters[2] = {};
+            filters[0].arg = 0;
+            filters[0].op = JNIHOOK_FILTER_EQ;
+            filters[0].string = "tenant";
+            filters[1].arg = 1;
+            filters[1].op = JNIHOOK_FILTER_GT;
+            filters[1].value.i = 10;
+
+            if (auto result = JNIHook_AttachFiltered(Target_filteredTest_mid, reinterpret_cast<void*>(hk_Target_filteredTest), &orig_Target_filteredTest, filters, 2); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to attach filtered hook: " << result << std::endl;
+                goto DETACH;
+            }
+
+            // Changing the values of the same filters must not redefine the class
+            jnihook_stats_t before, after;
+            JNIHook_GetStats(&before);
+            filters[1].value.i = 15;
+            if (auto result = JNIHook_AttachFiltered(Target_filteredTest_mid, reinterpret_cast<void*>(hk_Target_filteredTest), &orig_Target_filteredTest, filters, 2); result != JNIHOOK_OK) {
+                std::cerr << "[!] Failed to change filter values: " << result << std::endl;
+                goto DETACH;
+            }
+            JNIHook_GetStats(&after);
+            std::cout << "[*] Redefinitions while changing filter values: " << (after.redefinitions - before.redefinitions) << " (expected 0)" << std::endl;
+        }
+        std::cout << "[*] Target::filteredTest hooked successfully (name == \"tenant\" && value > 15)!" << std::endl;
+
+        if (auto result = JNIHook_AttachDeferred("dummy/Lazy", "compute", "(I)I", reinterpret_cast<void*>(hk_Lazy_compute), &orig_Lazy_compute); result != JNIHOOK_OK) {
+            std::cerr << "[!] Failed to attach deferred hook: " << result << std::endl;
+            goto DETACH;
+        }
+        std::cout << "[*] Lazy::compute deferred hook registered successfully!" << std::endl;
+
+#ifndef _WIN32
+        // The manifest agent is attached like with 'jcmd <pid> JVMTI.agent_load'
+        if (auto agent_path = getenv("JNIHOOK_AGENT"); !agent_path) {
+                std::cout << "[*] Skipping the manifest agent (JNIHOOK_AGENT is not set)" << std::endl;
+        } else {
+                Dl_info info;
+                void *agent;
+                jint (*agent_on_attach)(JavaVM *, char *, void *);
+
+                if (!dladdr(reinterpret_cast<void *>(hk_Manifest_compute), &info)) {
+                        std::cerr << "[!] Failed to find the path of the test library" << std::endl;
+                        goto DETACH;
+                }
+
+                std::string manifest_path = "jnihook_test.manifest";
+                std::ofstream manifest(manifest_path);
+                manifest << "# Written by the tests" << std::endl;
+                manifest << "dummy/Manifest compute (I)I " << info.dli_fname << " hk_Manifest_compute original=orig_Manifest_compute" << std::endl;
+                manifest.close();
+
+                if (!(agent = dlopen(agent_path, RTLD_NOW)) ||
+                    !(agent_on_attach = reinterpret_cast<decltype(agent_on_attach)>(dlsym(agent, "Agent_OnAttach")))) {
+                        std::cerr << "[!] Failed to load the manifest agent: " << agent_path << std::endl;
+                        goto DETACH;
+                }
+
+                if (auto result = agent_on_attach(jvm, manifest_path.data(), nullptr); result != JNI_OK) {
+                        std::cerr << "[!] Failed to attach the manifest hooks: " << result << std::endl;
+                        goto DETACH;
+                }
+                std::cout << "[*] Manifest::compute hook attached by the manifest agent!" << std::endl;
+        }
+#endif
+
         std::cout << "[*] Hooks attached" << std::endl;
+
+        {
+                jnihook_stats_t stats;
+
+                if (auto result = JNIHook_GetStats(&stats); result != JNIHOOK_OK) {
+                        std::cerr << "[!] Failed to get stats: " << result << std::endl;
+                        goto DETACH;
+                }
+
+                std::cout << "[*] Stats: " << stats.cached_classes << " cached classes, "
+                          << stats.native_hooks << " native hooks, " << stats.init_hooks << " constructor hooks, "
+                          << stats.bytecode_hooks << " bytecode hooks, " << stats.guarded_hooks << " guarded hooks, "
+                          << stats.probe_hooks << " probe hooks, " << stats.counter_hooks << " counter hooks, "
+                          << stats.sampled_hooks << " sampled hooks, " << stats.filtered_hooks << " filtered hooks, "
+                          << stats.redefinitions << " redefinitions" << std::endl;
+                std::cout << "[*] Disk cache: " << stats.disk_cache_hits << " hits, " << stats.disk_cache_misses
+                          << " misses (expected hits on the next runs)" << std::endl;
+        }
         
 DETACH:
         // JNIHook_Shutdown();